@@ -0,0 +1,684 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+#include "decode.h"
+#include "capture.h"
+#include "index.h"
+#include "lz.h"
+#include "util.h"
+
+/* A submission is a run of BO and PAGE records terminated by a SUBMIT
+ * record. BOs persist across submissions, so the capture is walked in order
+ * alongside decoding to resolve the contents of every BO as of each
+ * submission, keeping only the contents that submissions still to be written
+ * refer to. */
+
+/* Private copy of a BO's contents, made when a PAGE record patches it. It is
+ * shared by the submissions that saw these contents and by the capture
+ * state while it is current, and freed when none of them are left. */
+
+struct bo_copy {
+	unsigned refs;
+	uint8_t data[];
+};
+
+struct submission {
+	unsigned index;
+	unsigned cmdbuf;
+
+	struct agx_allocation *allocs;
+	unsigned alloc_count;
+
+	/* Per allocation, the copy it points into, or NULL if it points
+	 * straight into the capture */
+	struct bo_copy **copies;
+
+	/* Offset of the SUBMIT record in the capture */
+	uint64_t capture_offset;
+
+	/* Decoded text, filled in by a worker when decoding in parallel */
+	char *out;
+	size_t out_size;
+	bool done;
+
+	/* Bytes of output, packets in it and their addresses, when indexing */
+	uint64_t output_size;
+	struct agx_index_packet *packets;
+	unsigned packet_count;
+	struct agx_index_address *addresses;
+	unsigned address_count;
+};
+
+/* Current contents of a BO. Full snapshots point straight into the capture,
+ * unless it is compressed. PAGE records patch a private copy, copied again
+ * whenever a submission still to be written refers to the previous
+ * contents. */
+
+struct bo_state {
+	struct agx_allocation alloc;
+	struct bo_copy *copy;
+};
+
+struct capture_state {
+	struct agx_capture *cap;
+	struct bo_state *bos;
+	unsigned count, capacity;
+};
+
+static void *
+grow(void *array, unsigned *capacity, unsigned count, size_t size)
+{
+	if (count < *capacity)
+		return array;
+
+	*capacity = *capacity ? *capacity * 2 : 64;
+	array = realloc(array, *capacity * size);
+	if (!array)
+		err(4, "capture state");
+
+	return array;
+}
+
+static void
+copy_unref(struct bo_copy *copy)
+{
+	if (copy && --copy->refs == 0)
+		free(copy);
+}
+
+static struct bo_state *
+find_bo(struct capture_state *state, const struct agx_capture_record *rec)
+{
+	for (unsigned i = 0; i < state->count; ++i) {
+		struct bo_state *bo = &state->bos[i];
+
+		if (bo->alloc.type == rec->alloc_type && bo->alloc.index == rec->index)
+			return bo;
+	}
+
+	return NULL;
+}
+
+static void
+apply_page(struct capture_state *state, const struct agx_capture_record *rec,
+		const uint8_t *data)
+{
+	struct bo_state *bo = find_bo(state, rec);
+	size_t offset = (size_t) rec->page * AGX_CAPTURE_PAGE_SIZE;
+
+	if (!bo)
+		errx(3, "page of unknown BO %u", rec->index);
+
+	if (offset > bo->alloc.size || rec->size > bo->alloc.size - offset)
+		errx(3, "page %u out of bounds of BO %u", rec->page, rec->index);
+
+	/* Patch in place unless a submission still refers to the contents */
+	if (!bo->copy || bo->copy->refs > 1) {
+		struct bo_copy *copy = malloc(sizeof(*copy) + bo->alloc.size);
+		if (!copy)
+			err(4, "BO copy");
+
+		copy->refs = 1;
+		memcpy(copy->data, bo->alloc.map, bo->alloc.size);
+		copy_unref(bo->copy);
+
+		bo->copy = copy;
+		bo->alloc.map = copy->data;
+	}
+
+	memcpy((uint8_t *) bo->alloc.map + offset, data, rec->size);
+}
+
+/* Walks the capture up to the next SUBMIT record, filling in sub with the
+ * contents of every BO as of it. Returns false at the end of the capture. */
+
+static bool
+next_submission(struct capture_state *state, struct submission *sub, unsigned index)
+{
+	struct agx_capture *cap = state->cap;
+	const struct agx_capture_record *rec;
+	const uint8_t *data;
+
+	while ((rec = agx_capture_next(cap, &data))) {
+		switch (rec->type) {
+		case AGX_CAPTURE_BO: {
+			if (rec->alloc_type >= AGX_NUM_ALLOC)
+				errx(3, "bad allocation type %u", rec->alloc_type);
+
+			struct bo_state *bo = find_bo(state, rec);
+
+			if (!bo) {
+				state->bos = grow(state->bos, &state->capacity,
+						state->count, sizeof(*bo));
+				bo = &state->bos[state->count++];
+			} else {
+				copy_unref(bo->copy);
+			}
+
+			/* Zero-copy, point straight into the capture. Marked
+			 * read-only up front so the decoder skips mprotect */
+			*bo = (struct bo_state) {
+				.alloc = {
+					.type = rec->alloc_type,
+					.index = rec->index,
+					.gpu_va = rec->gpu_va,
+					.size = rec->size,
+					.map = (void *) data,
+					.ro = true,
+				},
+			};
+
+			/* Compressed captures only hold the record until the
+			 * next, so the contents are copied out */
+			if (cap->compressed) {
+				bo->copy = malloc(sizeof(*bo->copy) + rec->size);
+				if (!bo->copy)
+					err(4, "BO copy");
+
+				bo->copy->refs = 1;
+				memcpy(bo->copy->data, data, rec->size);
+				bo->alloc.map = bo->copy->data;
+			}
+			break;
+		}
+
+		case AGX_CAPTURE_PAGE:
+			apply_page(state, rec, data);
+			break;
+
+		case AGX_CAPTURE_SUBMIT: {
+			unsigned count = MAX2(state->count, 1);
+			struct agx_allocation *allocs = calloc(count, sizeof(*allocs));
+			struct bo_copy **copies = calloc(count, sizeof(*copies));
+
+			if (!allocs || !copies)
+				err(4, "submission table");
+
+			/* Later pages must not patch what this submission sees */
+			for (unsigned i = 0; i < state->count; ++i) {
+				allocs[i] = state->bos[i].alloc;
+				copies[i] = state->bos[i].copy;
+
+				if (copies[i])
+					copies[i]->refs++;
+			}
+
+			*sub = (struct submission) {
+				.index = index,
+				.cmdbuf = rec->index,
+				.allocs = allocs,
+				.alloc_count = state->count,
+				.copies = copies,
+				.capture_offset = cap->record_offset,
+			};
+
+			return true;
+		}
+
+		default:
+			errx(3, "unknown record type %u", rec->type);
+		}
+	}
+
+	return false;
+}
+
+/* Drops a written submission's hold on the BO contents it saw */
+
+static void
+release_submission(struct submission *sub)
+{
+	for (unsigned i = 0; i < sub->alloc_count; ++i)
+		copy_unref(sub->copies[i]);
+
+	free(sub->copies);
+	free(sub->allocs);
+}
+
+static void
+capture_state_fini(struct capture_state *state)
+{
+	for (unsigned i = 0; i < state->count; ++i)
+		copy_unref(state->bos[i].copy);
+
+	free(state->bos);
+}
+
+/* With -t or -n, packets are only decoded if they are of the given type, or
+ * are the given draw of the frame or the state bound for it */
+
+struct decode_filter {
+	const char *type;
+	int draw;
+};
+
+static bool
+filter_enabled(const struct decode_filter *filter)
+{
+	return filter->type || filter->draw >= 0;
+}
+
+/* Marks draw n and the last packet of every other kind before it in its
+ * encoder. Binds in records are told apart from the vertex pipeline bind. */
+
+static void
+select_draw(const struct pandecode_scanned_packet *packets, unsigned count,
+		int n, bool *selected)
+{
+	unsigned i;
+
+	for (i = 0; i < count; ++i) {
+		if (!strcmp(packets[i].type, "DRAW") && n-- == 0)
+			break;
+	}
+
+	if (i == count)
+		return;
+
+	selected[i] = true;
+
+	for (unsigned j = i; j-- > 0 && packets[j].encoder == packets[i].encoder; ) {
+		bool seen = !strcmp(packets[j].type, "DRAW") ||
+			packets[j].id == PANDECODE_PACKET_UNKNOWN;
+
+		for (unsigned k = j + 1; k < i && !seen; ++k) {
+			seen = packets[k].id == packets[j].id &&
+				packets[k].record == packets[j].record;
+		}
+
+		selected[j] = !seen;
+	}
+}
+
+/* Scans for packet boundaries first, then decodes only what was asked for */
+
+static void
+decode_filtered(struct pandecode_context *ctx, struct submission *sub,
+		bool verbose, const struct decode_filter *filter)
+{
+	unsigned count;
+	const struct pandecode_scanned_packet *packets =
+		pandecode_scan(ctx, sub->cmdbuf, &count);
+	bool *selected = calloc(MAX2(count, 1), sizeof(bool));
+
+	if (!selected)
+		err(4, "packet filter");
+
+	if (filter->draw >= 0)
+		select_draw(packets, count, filter->draw, selected);
+
+	for (unsigned i = 0; i < count; ++i) {
+		if (filter->draw >= 0 && !selected[i])
+			continue;
+
+		if (filter->type && strcasecmp(packets[i].type, filter->type))
+			continue;
+
+		pandecode_decode_packet(ctx, &packets[i], verbose);
+	}
+
+	pandecode_scan_finish(ctx);
+	free(selected);
+}
+
+/* Index of the output for -i. Workers add packet types as they find them,
+ * and the main thread adds frames in submission order. */
+
+static struct agx_index_builder index_builder;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+decode_submission(struct pandecode_context *ctx, struct submission *sub,
+		bool verbose, bool dump, bool index, const struct decode_filter *filter)
+{
+	pandecode_set_frame(ctx, sub->index);
+
+	for (unsigned i = 0; i < sub->alloc_count; ++i)
+		pandecode_track_alloc(ctx, sub->allocs[i]);
+
+	uint64_t start = pandecode_output_position(ctx);
+
+	if (filter_enabled(filter))
+		decode_filtered(ctx, sub, verbose, filter);
+	else
+		pandecode_cmdstream(ctx, sub->cmdbuf, verbose);
+
+	if (dump)
+		pandecode_dump_mappings(ctx);
+
+	if (index) {
+		unsigned count;
+		const struct pandecode_indexed_packet *packets =
+			pandecode_indexed_packets(ctx, &count);
+
+		sub->packets = calloc(MAX2(count, 1), sizeof(*sub->packets));
+		sub->packet_count = count;
+		sub->output_size = pandecode_output_position(ctx) - start;
+
+		if (!sub->packets)
+			err(4, "packet index");
+
+		pthread_mutex_lock(&index_lock);
+
+		for (unsigned i = 0; i < count; ++i) {
+			sub->packets[i] = (struct agx_index_packet) {
+				.va = packets[i].va,
+				.type = packets[i].id,
+				.offset = packets[i].offset,
+			};
+
+			agx_index_add_type(&index_builder, packets[i].id, packets[i].type);
+		}
+
+		const struct pandecode_indexed_address *addresses =
+			pandecode_indexed_addresses(ctx, &count);
+
+		sub->addresses = calloc(MAX2(count, 1), sizeof(*sub->addresses));
+		sub->address_count = count;
+
+		if (!sub->addresses)
+			err(4, "address index");
+
+		for (unsigned i = 0; i < count; ++i) {
+			const struct pandecode_indexed_packet *packet = &packets[addresses[i].packet];
+
+			sub->addresses[i] = (struct agx_index_address) {
+				.address = addresses[i].va,
+				.size = addresses[i].size,
+				.offset = packet->offset,
+				.type = packet->id,
+				.field = agx_index_add_field(&index_builder, addresses[i].field),
+				.encoder = packet->encoder,
+			};
+		}
+
+		pthread_mutex_unlock(&index_lock);
+	}
+
+	pandecode_untrack_all(ctx);
+}
+
+static void
+index_submission(struct submission *sub)
+{
+	agx_index_add_frame(&index_builder, sub->output_size, sub->capture_offset,
+			    sub->packets, sub->packet_count,
+			    sub->addresses, sub->address_count);
+	free(sub->packets);
+	free(sub->addresses);
+	sub->packets = NULL;
+	sub->addresses = NULL;
+}
+
+/* Parallel decoding hands out submissions to workers in order. Each worker
+ * has its own context and decodes into memory, then the main thread writes
+ * the results out in submission order. The main thread also walks the
+ * capture, resolving submissions only up to a window past the last written,
+ * and workers stay within it, to bound memory use. */
+
+struct decode_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Resolved so far, all of them once resolved is set */
+	struct submission **subs;
+	unsigned count, capacity, next, written, window;
+	bool resolved;
+
+	enum pandecode_format format;
+	bool verbose, dump, index;
+	const struct decode_filter *filter;
+};
+
+static void *
+decode_worker(void *data)
+{
+	struct decode_queue *q = data;
+	struct pandecode_context *ctx = pandecode_create_context();
+	pandecode_set_format(ctx, q->format);
+	pandecode_set_index(ctx, q->index);
+
+	pthread_mutex_lock(&q->lock);
+
+	for (;;) {
+		while ((q->next >= q->count && !q->resolved) ||
+		       (q->next < q->count && q->next >= q->written + q->window))
+			pthread_cond_wait(&q->cond, &q->lock);
+
+		if (q->next >= q->count)
+			break;
+
+		struct submission *sub = q->subs[q->next++];
+		pthread_mutex_unlock(&q->lock);
+
+		FILE *fp = open_memstream(&sub->out, &sub->out_size);
+		if (!fp)
+			err(4, "output buffer");
+
+		pandecode_set_dump_stream(ctx, fp);
+		decode_submission(ctx, sub, q->verbose, q->dump, q->index, q->filter);
+		pandecode_set_dump_stream(ctx, NULL);
+		fclose(fp);
+
+		pthread_mutex_lock(&q->lock);
+		sub->done = true;
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+	pandecode_destroy_context(ctx);
+	return NULL;
+}
+
+static void
+decode_parallel(FILE *out, struct capture_state *state,
+		unsigned threads, enum pandecode_format format,
+		bool verbose, bool dump, bool index, const struct decode_filter *filter)
+{
+	struct decode_queue q = {
+		.window = threads * 4,
+		.format = format,
+		.verbose = verbose,
+		.dump = dump,
+		.index = index,
+		.filter = filter,
+	};
+
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+
+	pthread_t *workers = calloc(threads, sizeof(pthread_t));
+
+	for (unsigned i = 0; i < threads; ++i)
+		pthread_create(&workers[i], NULL, decode_worker, &q);
+
+	/* Only this thread adds submissions, so it reads count unlocked */
+	for (unsigned i = 0; ; ++i) {
+		while (!q.resolved && q.count < i + q.window) {
+			struct submission *sub = calloc(1, sizeof(*sub));
+			if (!sub)
+				err(4, "submission");
+
+			bool found = next_submission(state, sub, q.count);
+
+			pthread_mutex_lock(&q.lock);
+
+			if (found) {
+				q.subs = grow(q.subs, &q.capacity, q.count, sizeof(*q.subs));
+				q.subs[q.count++] = sub;
+			} else {
+				q.resolved = true;
+				free(sub);
+			}
+
+			pthread_cond_broadcast(&q.cond);
+			pthread_mutex_unlock(&q.lock);
+		}
+
+		if (i == q.count)
+			break;
+
+		struct submission *sub = q.subs[i];
+
+		pthread_mutex_lock(&q.lock);
+		while (!sub->done)
+			pthread_cond_wait(&q.cond, &q.lock);
+		pthread_mutex_unlock(&q.lock);
+
+		fwrite(sub->out, 1, sub->out_size, out);
+		free(sub->out);
+
+		if (index)
+			index_submission(sub);
+
+		release_submission(sub);
+		free(sub);
+
+		pthread_mutex_lock(&q.lock);
+		q.subs[i] = NULL;
+		q.written++;
+		pthread_cond_broadcast(&q.cond);
+		pthread_mutex_unlock(&q.lock);
+	}
+
+	for (unsigned i = 0; i < threads; ++i)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	free(q.subs);
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+}
+
+int main(int argc, char **argv)
+{
+	bool verbose = false;
+	bool dump = false;
+	bool backrefs = false;
+	bool compress = false;
+	const char *index = NULL;
+	unsigned threads = 1;
+	enum pandecode_format format = PANDECODE_FORMAT_TEXT;
+	struct decode_filter filter = { .draw = -1 };
+	int c;
+
+	while ((c = getopt(argc, argv, "vdrzi:j:f:t:n:")) != -1) {
+		switch (c) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'd':
+			dump = true;
+			break;
+		case 'r':
+			backrefs = true;
+			break;
+		case 'z':
+			compress = true;
+			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			filter.type = optarg;
+			break;
+		case 'n':
+			filter.draw = atoi(optarg);
+			if (filter.draw < 0)
+				errx(1, "bad draw %s", optarg);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				format = PANDECODE_FORMAT_TEXT;
+			else if (!strcmp(optarg, "json"))
+				format = PANDECODE_FORMAT_JSON;
+			else if (!strcmp(optarg, "binary"))
+				format = PANDECODE_FORMAT_BINARY;
+			else if (!strcmp(optarg, "delta"))
+				format = PANDECODE_FORMAT_DELTA;
+			else if (!strcmp(optarg, "stats"))
+				format = PANDECODE_FORMAT_STATS;
+			else if (!strcmp(optarg, "waste"))
+				format = PANDECODE_FORMAT_WASTE;
+			else
+				errx(1, "unknown format %s", optarg);
+			break;
+		default:
+			errx(1, "usage: decode-bin [-v] [-d] [-r] [-z] [-i index] [-j threads] [-f text|json|binary|delta|stats|waste] [-t type] [-n draw] CAPTURE");
+		}
+	}
+
+	if (optind != argc - 1 || threads == 0)
+		errx(1, "usage: decode-bin [-v] [-d] [-r] [-z] [-i index] [-j threads] [-f text|json|binary|delta|stats|waste] [-t type] [-n draw] CAPTURE");
+
+	/* Back-references and deltas refer to earlier submissions, which only
+	 * makes sense decoding in order */
+	if (backrefs && threads > 1)
+		errx(1, "-r cannot be combined with -j");
+
+	if (format == PANDECODE_FORMAT_DELTA && threads > 1)
+		errx(1, "-f delta cannot be combined with -j");
+
+	/* Only these formats print packets to point into */
+	if (index && format != PANDECODE_FORMAT_TEXT && format != PANDECODE_FORMAT_JSON &&
+	    format != PANDECODE_FORMAT_BINARY)
+		errx(1, "-i needs -f text, json or binary");
+
+	/* Filtering skips most of the walk these need */
+	if (filter_enabled(&filter) && (dump || index || (format != PANDECODE_FORMAT_TEXT &&
+	    format != PANDECODE_FORMAT_JSON && format != PANDECODE_FORMAT_BINARY)))
+		errx(1, "-t and -n cannot be combined with -d, -i or -f delta, stats or waste");
+
+	struct agx_capture cap;
+	if (!agx_capture_open(&cap, argv[optind]))
+		err(2, "input file");
+
+	struct capture_state state = { .cap = &cap };
+
+	/* Compressed output is a stream of blocks in the format of lz.h */
+	FILE *out = compress ? agx_lz_fopen(stdout) : stdout;
+
+	if (threads > 1) {
+		decode_parallel(out, &state, threads, format, verbose, dump, index != NULL,
+				&filter);
+	} else {
+		struct pandecode_context *ctx = pandecode_create_context();
+		pandecode_set_format(ctx, format);
+		pandecode_set_backrefs(ctx, backrefs);
+		pandecode_set_dump_stream(ctx, out);
+		pandecode_set_index(ctx, index != NULL);
+
+		struct submission sub;
+
+		for (unsigned i = 0; next_submission(&state, &sub, i); ++i) {
+			decode_submission(ctx, &sub, verbose, dump, index != NULL, &filter);
+
+			if (index)
+				index_submission(&sub);
+
+			release_submission(&sub);
+		}
+
+		pandecode_destroy_context(ctx);
+	}
+
+	capture_state_fini(&state);
+
+	if (compress)
+		fclose(out);
+
+	if (index && !agx_index_write(&index_builder, index))
+		err(5, "index file");
+
+	agx_index_builder_fini(&index_builder);
+
+	agx_capture_close(&cap);
+	return 0;
+}
@@ -286,13 +286,10 @@ demo_unk2(struct agx_allocator *allocator, struct agx_allocation *vsbuf, struct
 
 	/* Must be after the rest */
 
-	bl_pack(out, DRAW, cfg) {
-		cfg.primitive = AGX_PRIMITIVE_TRIANGLE_STRIP;
-		cfg.vertex_start = 0;
-		cfg.vertex_count = 4;
-		cfg.instance_count = 1;
-	};
+	static const uint32_t draw[] =
+		AGX_DRAW_PACKED(AGX_PRIMITIVE_TRIANGLE_STRIP, 4, 1, 0);
 
+	memcpy(out, draw, AGX_DRAW_LENGTH);
 	out += AGX_DRAW_LENGTH;
 
 	uint8_t stop[] = {
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include "sink.h"
 
 /* Opcode table? Speculative since I don't know the opcode size yet, but this
  * should help bootstrap... These opcodes correspond to the bottom 7-bits of
@@ -168,25 +169,33 @@ struct agx_src {
 };
 
 static void
-agx_print_src(FILE *fp, struct agx_src s)
+agx_print_src(struct agx_sink *out, struct agx_src s)
 {
 	/* Known source types: immediates (8-bit only?), constant memory
 	 * (indexing 64-bits at a time from preloaded memory), and general
 	 * purpose registers */
 	const char *types[] = { "#", "unk1:", "u", "" };
 
-	fprintf(fp, ", %s%u%s%s%s%s",
-			types[s.type], s.reg,
-			(s.size32 || s.type == 0) ? "" : ((s.reg & 1) ? "h" : "l"),
-			s.abs ? ".abs" : "", s.neg ? ".neg" : "",
-			s.unk ? ".unk" : "");
+	agx_sink_lit(out, ", ");
+	agx_sink_puts(out, types[s.type]);
+	agx_sink_u64(out, s.reg);
+
+	if (!(s.size32 || s.type == 0))
+		agx_sink_putc(out, (s.reg & 1) ? 'h' : 'l');
+
+	if (s.abs)
+		agx_sink_lit(out, ".abs");
+	if (s.neg)
+		agx_sink_lit(out, ".neg");
+	if (s.unk)
+		agx_sink_lit(out, ".unk");
 }
 
 static void
-agx_print_float_src(FILE *fp, unsigned type, unsigned reg, bool size32, bool abs, bool neg)
+agx_print_float_src(struct agx_sink *out, unsigned type, unsigned reg, bool size32, bool abs, bool neg)
 {
 	assert(type <= 3);
-	agx_print_src(fp, (struct agx_src) {
+	agx_print_src(out, (struct agx_src) {
 			.type = type, .reg = reg, .size32 = size32,
 			.abs = abs, .neg = neg
 		});
@@ -223,17 +232,17 @@ agx_decode_float_src(uint16_t packed)
  */
 
 static void
-agx_print_fadd_f32(FILE *fp, uint8_t *code)
+agx_print_fadd_f32(struct agx_sink *out, uint8_t *code)
 {
-	agx_print_src(fp, agx_decode_float_src(code[2] | ((code[3] & 0xF) << 8)));
-	agx_print_src(fp, agx_decode_float_src((code[3] >> 4) | (code[4] << 4)));
+	agx_print_src(out, agx_decode_float_src(code[2] | ((code[3] & 0xF) << 8)));
+	agx_print_src(out, agx_decode_float_src((code[3] >> 4) | (code[4] << 4)));
 
 	if (code[5])
-		fprintf(fp, " /* unk5 = %02X */", code[5]);
+		agx_sink_printf(out, " /* unk5 = %02X */", code[5]);
 }
 
 static void
-agx_print_ld_compute(uint8_t *code, FILE *fp)
+agx_print_ld_compute(uint8_t *code, struct agx_sink *out)
 {
 	/* 4 bytes, first 2 used for opcode and dest reg, next few bits for the
 	 * component, the rest is a selector for what to load */
@@ -242,31 +251,31 @@ agx_print_ld_compute(uint8_t *code, FILE *fp)
 	unsigned component = arg & 0x3;
 	uint16_t selector = arg >> 2;
 
-	fprintf(fp, ", ");
+	agx_sink_lit(out, ", ");
 
 	switch (selector) {
 	case 0x00:
-		fprintf(fp, "[threadgroup_position_in_grid]");
+		agx_sink_lit(out, "[threadgroup_position_in_grid]");
 		break;
 	case 0x0c:
-		fprintf(fp, "[thread_position_in_threadgroup]");
+		agx_sink_lit(out, "[thread_position_in_threadgroup]");
 		break;
 	case 0x0d:
-		fprintf(fp, "[thread_position_in_simdgroup]");
+		agx_sink_lit(out, "[thread_position_in_simdgroup]");
 		break;
 	case 0x104:
-		fprintf(fp, "[thread_position_in_grid]");
+		agx_sink_lit(out, "[thread_position_in_grid]");
 		break;
 	default:
-		fprintf(fp, "[unk_%X]", selector);
+		agx_sink_printf(out, "[unk_%X]", selector);
 		break;
 	}
 
-	fprintf(fp, ".%c", "xyzw"[component]);
+	agx_sink_printf(out, ".%c", "xyzw"[component]);
 }
 
 static void
-agx_print_bitop_src(uint16_t value, FILE *fp)
+agx_print_bitop_src(uint16_t value, struct agx_sink *out)
 {
 	/* different encoding from float srcs -- slightly smaller */
 	uint16_t mode = (value >> 6) & 0x0f;
@@ -275,25 +284,25 @@ agx_print_bitop_src(uint16_t value, FILE *fp)
 	switch (mode) {
 	case 0x0:
 		// 8-bit immediate
-		fprintf(fp, "#0x%x", v);
+		agx_sink_printf(out, "#0x%x", v);
 		break;
 	case 0x3:
 		// 16b register
-		fprintf(fp, "h%d", v);
+		agx_sink_printf(out, "h%d", v);
 		break;
 	case 0xb:
 		// 32b register
 		assert((v&1) == 0);
-		fprintf(fp, "w%d", v >> 1);
+		agx_sink_printf(out, "w%d", v >> 1);
 		break;
 	default:
-		fprintf(fp, "unk_%x", value);
+		agx_sink_printf(out, "unk_%x", value);
 		break;
 	}
 }
 
 static void
-agx_print_bitop(uint8_t *code, FILE *fp)
+agx_print_bitop(uint8_t *code, struct agx_sink *out)
 {
 	/* 6 bytes */
 	/* Universal bitop instruction. Control bits express operation as
@@ -305,16 +314,16 @@ agx_print_bitop(uint8_t *code, FILE *fp)
 
 	uint8_t control = (code[3] >> 2) & 0x3;
 	control |= (code[4] >> 4) & 0xc; 
-	fprintf(fp, ", #0x%x, ", control);
+	agx_sink_printf(out, ", #0x%x, ", control);
 
 	uint16_t src1_bits = code[2] | ((uint16_t)(code[3]&3) << 8) |
 		((uint16_t)code[5]&0xc)<<8;
 	uint16_t src2_bits = (code[3] >> 4) | (((uint16_t)code[4]&0x3f)<<4) |
 		(((uint16_t)code[5]&0x3)<<10);
 
-	agx_print_bitop_src(src1_bits, fp);
-	fprintf(fp, ", ");
-	agx_print_bitop_src(src2_bits, fp);
+	agx_print_bitop_src(src1_bits, out);
+	agx_sink_lit(out, ", ");
+	agx_print_bitop_src(src2_bits, out);
 }
 
 static float
@@ -333,39 +342,39 @@ agx_decode_float_imm8(uint16_t src)
 }
 
 static void
-agx_print_fp16_src(uint16_t src, uint16_t type, FILE *fp)
+agx_print_fp16_src(uint16_t src, uint16_t type, struct agx_sink *out)
 {
 	/* XXX: type&2 bit may be something odd like code[0]&0x80 */
 
 	switch (type & 5) {
 	case 0x0:
 		/* packed float8 immediate */
-		fprintf(fp, "#%ff", agx_decode_float_imm8(src));
+		agx_sink_printf(out, "#%ff", agx_decode_float_imm8(src));
 		break;
 	case 0x1:
 		/* half register */
-		fprintf(fp, "h%d", src);
+		agx_sink_printf(out, "h%d", src);
 		break;
 	case 0x4:
 	case 0x5:
 		/* constant space; extra bit packed in
 		 * bottom bit of type */
-		fprintf(fp, "const_%d", ((type&1)<<8) | src);
+		agx_sink_printf(out, "const_%d", ((type&1)<<8) | src);
 		break;
 	default:
-		fprintf(fp, "unk_%x:%x", type, src);
+		agx_sink_printf(out, "unk_%x:%x", type, src);
 		break;
 	}
 
 	if (type & 0x8)
-		fprintf(fp, ".abs");
+		agx_sink_lit(out, ".abs");
 	if (type & 0x10)
-		fprintf(fp, ".neg");
+		agx_sink_lit(out, ".neg");
 
 }
 
 static void
-agx_print_fadd16(uint8_t *code, FILE *fp)
+agx_print_fadd16(uint8_t *code, struct agx_sink *out)
 {
 	/* 6 bytes */
 	uint16_t src1 = (code[2] & 0x3f) | ((code[5] & 0x0c)<<4);
@@ -374,33 +383,33 @@ agx_print_fadd16(uint8_t *code, FILE *fp)
 	uint16_t src2 = (code[3] >> 4) | ((code[4] & 0x3)<<4) | ((code[5] & 0x3)<<6);
 	uint16_t type2 = (code[4] >> 2);
 
-	fprintf(fp, ", ");
-	agx_print_fp16_src(src1, type1, fp);
-	fprintf(fp, ", ");
-	agx_print_fp16_src(src2, type2, fp);
+	agx_sink_lit(out, ", ");
+	agx_print_fp16_src(src1, type1, out);
+	agx_sink_lit(out, ", ");
+	agx_print_fp16_src(src2, type2, out);
 }
 
 static void
-agx_print_st_var(uint8_t *code, FILE *fp)
+agx_print_st_var(uint8_t *code, struct agx_sink *out)
 {
 	/* 4 bytes, first for opcode. Second for source register  third
 	 * indicates the destination, fourth unknown */
 	if (code[1] & 0x1)
-		fprintf(fp, ".unk");
+		agx_sink_lit(out, ".unk");
 
-	fprintf(fp, ", index:%u", code[2] & 0xF);
+	agx_sink_printf(out, ", index:%u", code[2] & 0xF);
 
 	if ((code[2] & 0xF0) != 0x80)
-		fprintf(fp, ", unk2=%X", code[2] >> 4);
+		agx_sink_printf(out, ", unk2=%X", code[2] >> 4);
 
 	if (code[3] != 0x80)
-		fprintf(fp, ", unk3=%X", code[3]);
+		agx_sink_printf(out, ", unk3=%X", code[3]);
 }
 
 /* Disassembles a single instruction */
 
 unsigned
-agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
+agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, struct agx_sink *out)
 {
 	/* Decode the opcode first, requires 2 bytes */
 	uint8_t opc = (code[0] & 0x7F) | (code[1] & 0x80);
@@ -411,43 +420,45 @@ agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
 	/* Hexdump the instruction */
 
 	if (verbose || !agx_opcode_table[opc].complete) {
-		fprintf(fp, "#");
-		for (unsigned i = 0; i < bytes; ++i)
-			fprintf(fp, " %02X", code[i]);
-		fprintf(fp, "\n");
+		agx_sink_lit(out, "#");
+		for (unsigned i = 0; i < bytes; ++i) {
+			agx_sink_putc(out, ' ');
+			agx_sink_hex(out, code[i], 2, true);
+		}
+		agx_sink_lit(out, "\n");
 	}
 
 	unsigned op_unk80 = code[0] & 0x80; /* XXX: what is this? */
-	fprintf(fp, "%c", op_unk80 ? '+' : '-'); /* Stay concise.. */
+	agx_sink_putc(out, op_unk80 ? '+' : '-'); /* Stay concise.. */
 
 	if (agx_opcode_table[opc].name)
-		fputs(agx_opcode_table[opc].name, fp);
+		agx_sink_puts(out, agx_opcode_table[opc].name);
 	else
-		fprintf(fp, "op_%02X", opc);
+		agx_sink_printf(out, "op_%02X", opc);
 
 	if (opc == OPC_ICSEL) {
 		unsigned mode = (code[7] & 0xF0) >> 4;
 		if (mode == 0x1)
-			fprintf(fp, ".eq"); // output 16-bit bool
+			agx_sink_lit(out, ".eq"); // output 16-bit bool
 		else if (mode == 0x2)
-			fprintf(fp, ".imin");
+			agx_sink_lit(out, ".imin");
 		else if (mode == 0x3)
-			fprintf(fp, ".ult"); // output 16-bit bool
+			agx_sink_lit(out, ".ult"); // output 16-bit bool
 		else if (mode == 0x4)
-			fprintf(fp, ".imax");
+			agx_sink_lit(out, ".imax");
 		else if (mode == 0x5)
-			fprintf(fp, ".ugt"); // output 16-bit bool
+			agx_sink_lit(out, ".ugt"); // output 16-bit bool
 		else
-			fprintf(fp, ".unk%X", mode);
+			agx_sink_printf(out, ".unk%X", mode);
 	} else if (opc == OPC_FCSEL) {
 		unsigned mode = (code[7] & 0xF0) >> 4;
 
 		if (mode == 0x6)
-			fprintf(fp, ".fmin");
+			agx_sink_lit(out, ".fmin");
 		else if (mode == 0xE)
-			fprintf(fp, ".fmax");
+			agx_sink_lit(out, ".fmax");
 		else
-			fprintf(fp, ".unk%X", mode);
+			agx_sink_printf(out, ".unk%X", mode);
 	}
 
 	/* Decode destination register, common to all ALUs (and maybe more?) */
@@ -459,26 +470,26 @@ agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
 	if (opc == OPC_ST_VAR)
 		dest_32 = !dest_32;
 
-	fprintf(fp, " %s%u",
-			dest_32 ? "w" : "h",
-			dest_reg);
+	agx_sink_putc(out, ' ');
+	agx_sink_putc(out, dest_32 ? 'w' : 'h');
+	agx_sink_u64(out, dest_reg);
 
 	/* Decode other stuff, TODO */
 	switch (opc) {
 	case OPC_ST_VAR:
-		agx_print_st_var(code, fp);
+		agx_print_st_var(code, out);
 		break;
 	case OPC_LD_COMPUTE:
-		agx_print_ld_compute(code, fp);
+		agx_print_ld_compute(code, out);
 		break;
 	case OPC_BITOP:
-		agx_print_bitop(code, fp);
+		agx_print_bitop(code, out);
 		break;
 	case OPC_FADD_16:
 	case OPC_FADD_SAT_16:
 	case OPC_FMUL_16:
 	case OPC_FMUL_SAT_16:
-		agx_print_fadd16(code, fp);
+		agx_print_fadd16(code, out);
 		break;
 	case OPC_MOVI: {
 		uint32_t imm = code[2] | (code[3] << 8);
@@ -486,21 +497,21 @@ agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
 		if (dest_32)
 			imm |= (code[4] << 16) | (code[5] << 24);
 
-		fprintf(fp, ", #0x%X", imm);
+		agx_sink_printf(out, ", #0x%X", imm);
 		break;
 	}
 	case OPC_FADD_32:
 	case OPC_FADD_SAT_32:
 	case OPC_FMUL_32:
 	case OPC_FMUL_SAT_32:
-		agx_print_fadd_f32(fp, code);
+		agx_print_fadd_f32(out, code);
 		break;
 	default: {
 		/* Make some guesses */
 		bool iadd = opc == OPC_IADD;
 
 		if (bytes > 2) {
-			agx_print_float_src(fp,
+			agx_print_float_src(out,
 				(code[2] & 0xC0) >> 6,
 				(code[2] & 0x3F) |
 					(iadd ? ((code[5] & 0x0C) << 4) : 0),
@@ -509,7 +520,7 @@ agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
 				code[3] & 0x04,
 				code[3] & 0x08);
 
-			agx_print_float_src(fp,
+			agx_print_float_src(out,
 				(code[4] & 0x0C) >> 2,
 				((code[3] >> 4) & 0xF) | ((code[4] & 0x3) << 4) | ((code[7] & 0x3) << 6),
 				code[4] & 0x20,
@@ -518,7 +529,7 @@ agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
 		}
 
 		if (bytes > 6 && !iadd) {
-			agx_print_float_src(fp,
+			agx_print_float_src(out,
 				(code[5] & 0xC0) >> 6,
 				(code[5] & 0x3F) | (code[6] & 0xC0),
 				code[6] & 0x20,
@@ -530,7 +541,7 @@ agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
 	}
 	}
 
-	fprintf(fp, "\n");
+	agx_sink_lit(out, "\n");
 
 	if (code[0] == (OPC_STOP | 0x80))
 		*stop = true;
@@ -541,7 +552,7 @@ agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
 /* Disassembles a shader */
 
 void
-agx_disassemble(void *_code, size_t maxlen, FILE *fp)
+agx_disassemble_sink(void *_code, size_t maxlen, struct agx_sink *out)
 {
 	if (maxlen > 256)
 		maxlen = 256;
@@ -552,9 +563,50 @@ agx_disassemble(void *_code, size_t maxlen, FILE *fp)
 	unsigned bytes = 0;
 	bool verbose = getenv("ASAHI_VERBOSE") != NULL;
 
-	while((bytes + 8) < maxlen && !stop)
-		bytes += agx_disassemble_instr(code + bytes, &stop, verbose, fp);
+	while ((bytes + 2) <= maxlen && !stop) {
+		/* Never read past maxlen for a truncated last instruction */
+		uint8_t opc = (code[bytes] & 0x7F) | (code[bytes + 1] & 0x80);
+
+		if (bytes + agx_instr_bytes(opc, code[bytes + 1]) > maxlen)
+			break;
+
+		bytes += agx_disassemble_instr(code + bytes, &stop, verbose, out);
+	}
 
 	if (!stop)
-		fprintf(fp, "// error: stop instruction not found\n");
+		agx_sink_lit(out, "// error: stop instruction not found\n");
+}
+
+/* Size in bytes of a shader up to and including its stop instruction, found
+ * from the instruction lengths alone, without disassembling. Without a stop
+ * in the first maxlen bytes, returns the bytes walked and clears *stop. Never
+ * returns more than maxlen. */
+
+size_t
+agx_shader_size(void *_code, size_t maxlen, bool *stop)
+{
+	uint8_t *code = _code;
+	size_t bytes = 0;
+
+	*stop = false;
+
+	while ((bytes + 2) <= maxlen && !*stop) {
+		*stop = (code[bytes] == (OPC_STOP | 0x80));
+		bytes += agx_instr_bytes((code[bytes] & 0x7F) | (code[bytes + 1] & 0x80),
+					 code[bytes + 1]);
+	}
+
+	return bytes < maxlen ? bytes : maxlen;
+}
+
+/* Convenience for callers without a sink of their own */
+
+void
+agx_disassemble(void *code, size_t maxlen, FILE *fp)
+{
+	char buf[4096];
+	struct agx_sink out;
+	agx_sink_init_buffer(&out, fp, buf, sizeof(buf));
+	agx_disassemble_sink(code, maxlen, &out);
+	agx_sink_fini(&out);
 }
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "lz.h"
+#include "util.h"
+
+/* Decompresses the next block of a compressed capture. A truncated or
+ * corrupt block ends the capture, as a truncated record would. */
+
+static bool
+capture_next_block(struct agx_capture *cap)
+{
+	struct agx_lz_block block;
+
+	if (cap->offset + sizeof(block) > cap->size)
+		return false;
+
+	memcpy(&block, cap->map + cap->offset, sizeof(block));
+	cap->offset += sizeof(block);
+
+	if (block.raw_size > AGX_LZ_BLOCK_SIZE || block.packed_size > block.raw_size ||
+	    block.packed_size > cap->size - cap->offset)
+		return false;
+
+	const uint8_t *packed = cap->map + cap->offset;
+
+	if (block.packed_size == block.raw_size)
+		memcpy(cap->block, packed, block.raw_size);
+	else if (!agx_lz_decompress(packed, block.packed_size, cap->block, block.raw_size)) {
+		fprintf(stderr, "capture: corrupt block at offset %zu\n",
+				cap->offset - sizeof(block));
+		return false;
+	}
+
+	cap->offset += block.packed_size;
+	cap->block_size = block.raw_size;
+	cap->block_offset = 0;
+	return true;
+}
+
+/* Reads n bytes of a compressed capture into dst, or skips them if dst is
+ * NULL */
+
+static bool
+capture_read(struct agx_capture *cap, void *dst, size_t n)
+{
+	while (n) {
+		if (cap->block_offset == cap->block_size && !capture_next_block(cap))
+			return false;
+
+		size_t chunk = MIN2(n, cap->block_size - cap->block_offset);
+
+		if (dst) {
+			memcpy(dst, cap->block + cap->block_offset, chunk);
+			dst = (uint8_t *) dst + chunk;
+		}
+
+		cap->block_offset += chunk;
+		cap->raw_offset += chunk;
+		n -= chunk;
+	}
+
+	return true;
+}
+
+bool
+agx_capture_open(struct agx_capture *cap, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct agx_capture_header)) {
+		close(fd);
+		return false;
+	}
+
+	/* Private read-only mapping, the decoder never writes to BOs */
+	size_t size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	*cap = (struct agx_capture) {
+		.map = map,
+		.size = size,
+		.offset = sizeof(struct agx_capture_header),
+	};
+
+	struct agx_capture_header header;
+	memcpy(&header, map, sizeof(header));
+
+	/* Compressed captures are read a block at a time, starting with the
+	 * header of the capture inside */
+	if (agx_lz_is_stream(map, size)) {
+		cap->compressed = true;
+		cap->offset = sizeof(struct agx_lz_header);
+		cap->block = malloc(AGX_LZ_BLOCK_SIZE);
+
+		if (!cap->block || !capture_read(cap, &header, sizeof(header))) {
+			fprintf(stderr, "capture: truncated compressed capture\n");
+			agx_capture_close(cap);
+			return false;
+		}
+	}
+
+	/* Version 1 is version 2 without PAGE records */
+	if (header.magic != AGX_CAPTURE_MAGIC ||
+	    header.version < 1 || header.version > AGX_CAPTURE_VERSION) {
+		fprintf(stderr, "capture: bad header %08X version %u\n",
+				header.magic, header.version);
+		agx_capture_close(cap);
+		return false;
+	}
+
+	return true;
+}
+
+void
+agx_capture_close(struct agx_capture *cap)
+{
+	munmap((void *) cap->map, cap->size);
+	free(cap->block);
+	free(cap->data);
+	cap->map = NULL;
+	cap->block = NULL;
+	cap->data = NULL;
+}
+
+/* Compressed captures copy each record header out of the stream. Data is
+ * left in place if it is all in the current block, and copied otherwise. */
+
+static const struct agx_capture_record *
+capture_next_compressed(struct agx_capture *cap, const uint8_t **data)
+{
+	struct agx_capture_record *rec = &cap->record;
+
+	if (!capture_read(cap, NULL, ALIGN_POT(cap->raw_offset, AGX_CAPTURE_ALIGN) - cap->raw_offset))
+		return NULL;
+
+	cap->record_offset = cap->raw_offset;
+
+	if (!capture_read(cap, rec, sizeof(*rec)))
+		return NULL;
+
+	if (rec->size <= cap->block_size - cap->block_offset) {
+		*data = cap->block + cap->block_offset;
+		capture_read(cap, NULL, rec->size);
+		return rec;
+	}
+
+	if (rec->size > cap->data_capacity) {
+		uint8_t *grown = realloc(cap->data, rec->size);
+
+		if (!grown) {
+			fprintf(stderr, "capture: no memory for a record of %" PRIu64 " bytes\n",
+					rec->size);
+			return NULL;
+		}
+
+		cap->data = grown;
+		cap->data_capacity = rec->size;
+	}
+
+	if (!capture_read(cap, cap->data, rec->size))
+		return NULL;
+
+	*data = cap->data;
+	return rec;
+}
+
+/* Returns the next record, pointing data at its payload inside the mapping,
+ * or NULL at the end of the capture. A truncated final record (e.g. if the
+ * traced app crashed mid-write) is treated as the end. */
+
+const struct agx_capture_record *
+agx_capture_next(struct agx_capture *cap, const uint8_t **data)
+{
+	if (cap->compressed)
+		return capture_next_compressed(cap, data);
+
+	if (cap->offset + sizeof(struct agx_capture_record) > cap->size)
+		return NULL;
+
+	const struct agx_capture_record *rec =
+		(const struct agx_capture_record *) (cap->map + cap->offset);
+
+	size_t start = cap->offset + sizeof(*rec);
+
+	if (rec->size > cap->size - start)
+		return NULL;
+
+	*data = cap->map + start;
+	cap->record_offset = cap->offset;
+	cap->offset = ALIGN_POT(start + rec->size, AGX_CAPTURE_ALIGN);
+	return rec;
+}
+
+void
+agx_capture_write_header(FILE *fp)
+{
+	struct agx_capture_header header = {
+		.magic = AGX_CAPTURE_MAGIC,
+		.version = AGX_CAPTURE_VERSION,
+	};
+
+	fwrite(&header, 1, sizeof(header), fp);
+}
+
+void
+agx_capture_write(FILE *fp, const struct agx_capture_record *rec,
+		const void *data)
+{
+	static const uint8_t zeroes[AGX_CAPTURE_ALIGN] = { 0 };
+
+	size_t total = sizeof(*rec) + rec->size;
+	size_t padding = ALIGN_POT(total, AGX_CAPTURE_ALIGN) - total;
+
+	fwrite(rec, 1, sizeof(*rec), fp);
+
+	if (rec->size)
+		fwrite(data, 1, rec->size, fp);
+
+	fwrite(zeroes, 1, padding, fp);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_CAPTURE_H
+#define __AGX_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Capture files let the decoder run offline, away from the traced machine.
+ * A capture is a header followed by a flat sequence of records. Each
+ * submission is recorded as a BO record for every CPU-mapped buffer, holding
+ * a snapshot of its contents, then a SUBMIT record naming the command
+ * buffer. Record data is padded so the next record stays aligned, which lets
+ * a reader mmap the file and point allocations straight at the snapshots.
+ *
+ * Since version 2, BOs persist from one submission to the next. A BO that
+ * was already captured is only recorded again if the CPU wrote to it since,
+ * either as a new BO record or, if few pages changed, as one PAGE record per
+ * changed page patching the previous contents.
+ *
+ * A capture may also be wrapped in a compressed stream (see lz.h), which
+ * agx_capture_next decompresses a block at a time as it goes. */
+
+#define AGX_CAPTURE_MAGIC (0x43584741) /* "AGXC" */
+#define AGX_CAPTURE_VERSION (2)
+#define AGX_CAPTURE_ALIGN (64)
+#define AGX_CAPTURE_PAGE_SIZE (16384)
+
+struct agx_capture_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t padding[14];
+} __attribute__((packed));
+
+enum agx_capture_record_type {
+	AGX_CAPTURE_BO = 1,
+	AGX_CAPTURE_SUBMIT = 2,
+	AGX_CAPTURE_PAGE = 3,
+};
+
+struct agx_capture_record {
+	/* enum agx_capture_record_type */
+	uint32_t type;
+
+	/* BO index (unique up to alloc_type), or the submitted command buffer */
+	uint32_t index;
+
+	/* enum agx_alloc_type, for BOs and pages */
+	uint32_t alloc_type;
+
+	/* For pages, offset into the BO in units of AGX_CAPTURE_PAGE_SIZE */
+	uint32_t page;
+
+	uint64_t gpu_va;
+
+	/* Bytes of data following the record, before alignment */
+	uint64_t size;
+} __attribute__((packed));
+
+struct agx_capture {
+	/* The file, and the offset of the next record or compressed block */
+	const uint8_t *map;
+	size_t size;
+	size_t offset;
+
+	/* Offset of the last record returned, before compression */
+	uint64_t record_offset;
+
+	/* For compressed captures, the block being read, the offset of the
+	 * next record into the uncompressed stream, the last record returned
+	 * and its data if it did not fit in one block */
+	bool compressed;
+	uint8_t *block;
+	size_t block_size, block_offset;
+	uint64_t raw_offset;
+	struct agx_capture_record record;
+	uint8_t *data;
+	size_t data_capacity;
+};
+
+bool agx_capture_open(struct agx_capture *cap, const char *path);
+void agx_capture_close(struct agx_capture *cap);
+
+/* Records and their data point into the file mapping, except for compressed
+ * captures, where they are only valid until the next call */
+
+const struct agx_capture_record *
+agx_capture_next(struct agx_capture *cap, const uint8_t **data);
+
+void agx_capture_write_header(FILE *fp);
+
+void agx_capture_write(FILE *fp, const struct agx_capture_record *rec,
+		const void *data);
+
+#endif
@@ -23,458 +23,2762 @@
  * SOFTWARE.
  */
 
-#include <agx_pack.h>
 #include <stdio.h>
+#include <stdint.h>
+
+/* Resolve address fields in JSON output against the tracked mappings */
+struct pandecode_context;
+struct agx_sink;
+static void pandecode_json_address(struct agx_sink *out, struct pandecode_context *ctx, uint64_t va);
+static void pandecode_print_address(struct agx_sink *out, struct pandecode_context *ctx, uint64_t va);
+static void pandecode_index_address(struct pandecode_context *ctx, const char *field, uint64_t va);
+#define __gen_json_address(out, data, va) pandecode_json_address(out, data, va)
+#define __gen_print_address(out, data, va) pandecode_print_address(out, data, va)
+#define __gen_visit_address(data, name, va) pandecode_index_address(data, name, va)
+
+#include <agx_pack.h>
 #include <stdlib.h>
 #include <memory.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+
+#include "decode.h"
+#include "capture.h"
+#include "sink.h"
+#include "lz.h"
+
+extern void agx_disassemble_sink(void *_code, size_t maxlen, struct agx_sink *out);
+extern size_t agx_shader_size(void *_code, size_t maxlen, bool *stop);
+
+/* Memory handling, this can't pull in proper data structures so hardcode some
+ * things, it should be "good enough" for most use cases */
+
+#define MAX_MAPPINGS 4096
+
+/* Pipelines are referenced by every draw and rebound every frame, but rarely
+ * change, so the decoded text is cached by address. An entry is reused only
+ * if every byte the decode read (the pipeline itself and the shaders it
+ * points to) still hashes the same. */
+
+#define PIPELINE_CACHE_SIZE 256
+#define PIPELINE_MAX_RANGES 8
+#define PIPELINE_MAX_SHADERS 8
+
+/* In soak mode (see pandecode_ring_configure), state that otherwise grows
+ * with the length of the trace is cut back past these */
+
+#define RING_MAX_NAMES (2 * MAX_MAPPINGS)
+#define RING_MAX_HASHES (1 << 16)
+
+struct pandecode_range {
+        uint64_t va;
+        size_t size;
+};
+
+struct pandecode_shader_use {
+        uint64_t hash;
+        size_t size;
+        bool preshader;
+};
+
+struct pandecode_cached_pipeline {
+        uint64_t va;
+        uint64_t hash;
+        int frame;
+
+        struct pandecode_range ranges[PIPELINE_MAX_RANGES];
+        unsigned range_count;
+        bool overflow;
+
+        char *text;
+        size_t text_len;
+
+        /* Shaders stored while decoding, to index them again on a hit */
+        struct pandecode_shader_use shaders[PIPELINE_MAX_SHADERS];
+        unsigned shader_count;
+
+        /* Ranges the decode found reachable, see pandecode_reach */
+        struct pandecode_range *reach;
+        unsigned reach_count;
+
+        /* Packets decoded, with offsets into text, and their addresses */
+        struct pandecode_indexed_packet *packets;
+        unsigned packet_count;
+
+        struct pandecode_indexed_address *addresses;
+        unsigned address_count;
+};
+
+/* All decoder state lives in a context, so independent submissions can be
+ * decoded concurrently with one context per thread */
+
+/* Packets of one frame kept for delta decoding, with their packed bytes
+ * concatenated in data */
+
+struct pandecode_packet {
+        unsigned id;
+        const char *type;
+        uint64_t va;
+        size_t size, offset;
+};
+
+struct pandecode_frame {
+        struct pandecode_packet *packets;
+        unsigned count, capacity;
+
+        uint8_t *data;
+        size_t data_size, data_capacity;
+};
+
+/* Packets indexed while decoding, with the addresses they hold */
+
+struct pandecode_packet_list {
+        struct pandecode_indexed_packet *packets;
+        unsigned count, capacity;
+
+        struct pandecode_indexed_address *addresses;
+        unsigned address_count, address_capacity;
+};
+
+/* Set of 64-bit hashes, open addressed with zero as the empty slot */
+
+struct pandecode_set {
+        uint64_t *slots;
+        unsigned count, capacity;
+};
+
+/* Hash of every page of a captured BO as of the last capture, used to find
+ * the pages the CPU wrote since. Hashing reads every page but is far cheaper
+ * than writing them all out, and needs no fault handling in the traced app. */
+
+struct pandecode_pages {
+        uint64_t *hashes;
+        bool *dirty;
+};
+
+/* Allocation names are interned into blocks that never move, so names can be
+ * compared by pointer and stay valid until the context is destroyed */
+
+#define NAME_BLOCK_SIZE 16384
+
+struct pandecode_name_block {
+        struct pandecode_name_block *next;
+        size_t used;
+        char data[NAME_BLOCK_SIZE];
+};
+
+/* Soak mode writes dumps and captures as a ring of numbered segment files,
+ * deleting the oldest as new ones are started */
+
+struct pandecode_ring_segment {
+        char *path;
+        unsigned frames;
+        uint64_t bytes;
+
+        /* For kept segments, the trigger that kept them */
+        unsigned snapshot;
+};
+
+struct pandecode_ring {
+        struct pandecode_ring_segment *segments;
+        unsigned count, capacity;
+        unsigned next;
+};
+
+/* Entry of the address-sorted view of the tracked mappings */
+
+struct pandecode_mapping {
+        uint64_t gpu_va;
+        unsigned index;
+};
+
+/* Per-frame totals for the statistics format */
+
+struct pandecode_stats {
+        unsigned draws, launches, records;
+        unsigned pipeline_binds, uniform_binds;
+
+        /* Bytes of command streams, records and shaders walked, by the type
+         * of the BO they live in */
+        uint64_t bytes[AGX_NUM_ALLOC];
+        uint64_t shader_bytes;
+};
+
+/* Classes of redundant work found by the waste format. Uploads are data
+ * identical to something already uploaded elsewhere this frame; rebinds and
+ * state records set an encoder state to what it already was. */
+
+enum pandecode_waste_class {
+        WASTE_UNIFORM_UPLOADS,
+        WASTE_RECORD_UPLOADS,
+        WASTE_PIPELINE_UPLOADS,
+        WASTE_SHADER_UPLOADS,
+        WASTE_PIPELINE_REBINDS,
+        WASTE_STATE_RECORDS,
+        WASTE_NUM_CLASSES,
+};
+
+static const char *pandecode_waste_names[WASTE_NUM_CLASSES] = {
+        [WASTE_UNIFORM_UPLOADS] = "uniform uploads",
+        [WASTE_RECORD_UPLOADS] = "record uploads",
+        [WASTE_PIPELINE_UPLOADS] = "pipeline uploads",
+        [WASTE_SHADER_UPLOADS] = "shader uploads",
+        [WASTE_PIPELINE_REBINDS] = "pipeline rebinds",
+        [WASTE_STATE_RECORDS] = "state records",
+};
+
+/* Encoder state compared against the last value bound */
+
+enum pandecode_waste_slot {
+        WASTE_SLOT_VERTEX_PIPELINE,
+        WASTE_SLOT_FRAGMENT_PIPELINE,
+        WASTE_SLOT_VIEWPORT,
+        WASTE_SLOT_LINKAGE,
+        WASTE_NUM_SLOTS,
+};
+
+struct pandecode_waste_count {
+        unsigned packets;
+        uint64_t bytes;
+};
+
+/* Share of the frame totals taken by one encoder */
+
+struct pandecode_encoder_stats {
+        uint64_t va;
+        unsigned draws, launches, records;
+
+        /* Command stream and record bytes, of any BO type */
+        uint64_t bytes;
+        uint64_t shader_bytes;
+        uint64_t ns;
+};
+
+struct pandecode_context {
+        FILE *dump_stream;
+
+        /* Buffered output to dump_stream, all decoder text goes here */
+        struct agx_sink out;
+
+        /* Set if the stream was supplied by the caller, so we don't close it */
+        bool external_stream;
+
+        FILE *capture_stream;
+
+        enum pandecode_format format;
+        unsigned indent;
+        int dump_frame_count;
+
+        struct agx_allocation mmap_array[MAX_MAPPINGS];
+        unsigned mmap_count;
+
+        /* mmap_array sorted by GPU address, rebuilt on the first lookup
+         * after the mappings change */
+        struct pandecode_mapping by_va[MAX_MAPPINGS];
+        bool by_va_valid;
+
+        /* Interned allocation names, with an open-addressed table of them */
+        struct pandecode_name_block *names;
+        char **name_table;
+        unsigned name_count, name_capacity;
+
+        struct agx_allocation *ro_mappings[MAX_MAPPINGS];
+        unsigned ro_mapping_count;
+
+        /* Parallel to mmap_array, for captures */
+        struct pandecode_pages pages[MAX_MAPPINGS];
+
+        struct pandecode_cached_pipeline pipeline_cache[PIPELINE_CACHE_SIZE];
+
+        /* Entry being filled, every fetch is recorded against it */
+        struct pandecode_cached_pipeline *caching;
+
+        /* Print a reference instead of replaying cached pipelines */
+        bool backrefs;
+
+        struct pandecode_stats stats;
+
+        /* With indexing, packets of the last cmdstream decoded with their
+         * offsets from index_base in the output, and those of the pipeline
+         * being cached with offsets into its text */
+        bool indexing;
+        struct pandecode_packet_list index, cache_index;
+        uint64_t index_base;
+
+        /* With the waste format, hashes of the contents uploaded this
+         * cmdstream and of (contents, address) pairs, the totals so far, the
+         * contents of the pipeline last walked and of each state last bound
+         * in the current encoder */
+        struct pandecode_set waste_contents, waste_sites;
+        struct pandecode_waste_count waste[WASTE_NUM_CLASSES];
+        uint64_t waste_pipeline;
+        uint64_t waste_bound[WASTE_NUM_SLOTS];
+
+        /* Packets found by the last pandecode_scan */
+        struct pandecode_scanned_packet *scan;
+        unsigned scan_count, scan_capacity;
+
+        /* Encoders of the last command buffer decoded */
+        struct pandecode_encoder_stats *encoders;
+        unsigned encoder_count, encoder_capacity;
+
+        /* GPU memory reachable from the last cmdstream decoded, along with
+         * its command buffer */
+        struct pandecode_range *reach;
+        unsigned reach_count, reach_capacity;
+        struct agx_allocation *cmdbuf;
+
+        /* Hashes of buffers already in the BO store */
+        struct pandecode_set stored;
+
+        /* Shader corpus, see pandecode_shader. The directory is looked up on
+         * first use, and the index lists each (pipeline, shader) pair used
+         * once per frame. */
+        bool shader_store_checked;
+        const char *shader_store;
+        FILE *shader_index;
+        struct pandecode_set shaders_stored;
+        struct pandecode_set shader_uses;
+        uint64_t pipeline_va;
+
+        /* For delta decoding, the previous and current frame */
+        struct pandecode_frame frames[2];
+        unsigned current_frame;
+
+        /* Soak mode, configured from the environment on first use. Segments
+         * are kept to the last ring_frames submissions or ring_bytes bytes.
+         * dump_mark is the output position the current dump segment started
+         * at. Triggers keep the segments so far as a numbered snapshot in
+         * kept_ring, of which the last ring_keep are kept. */
+        bool ring_checked, ring_enabled;
+        unsigned ring_frames, ring_keep, ring_snapshots;
+        uint64_t ring_bytes, ring_segment;
+        struct pandecode_ring dump_ring, capture_ring, kept_ring;
+        uint64_t dump_mark;
+};
+
+static void pandecode_ring_configure(struct pandecode_context *ctx);
+static void pandecode_ring_fini(struct pandecode_ring *ring);
+static void pandecode_ring_rotate(struct pandecode_context *ctx);
+static void pandecode_ring_frame(struct pandecode_context *ctx);
+static void pandecode_dump_file_close(struct pandecode_context *ctx);
+
+struct pandecode_context *
+pandecode_create_context(void)
+{
+        struct pandecode_context *ctx = calloc(1, sizeof(*ctx));
+        assert(ctx != NULL);
+        agx_sink_init(&ctx->out, NULL);
+        return ctx;
+}
+
+void
+pandecode_destroy_context(struct pandecode_context *ctx)
+{
+        pandecode_close(ctx);
+        agx_sink_fini(&ctx->out);
+
+        for (unsigned i = 0; i < PIPELINE_CACHE_SIZE; ++i) {
+                free(ctx->pipeline_cache[i].text);
+                free(ctx->pipeline_cache[i].reach);
+                free(ctx->pipeline_cache[i].packets);
+                free(ctx->pipeline_cache[i].addresses);
+        }
+
+        free(ctx->index.packets);
+        free(ctx->index.addresses);
+        free(ctx->cache_index.packets);
+        free(ctx->cache_index.addresses);
+
+        free(ctx->reach);
+        free(ctx->scan);
+        free(ctx->encoders);
+
+        free(ctx->stored.slots);
+        free(ctx->shaders_stored.slots);
+        free(ctx->shader_uses.slots);
+        free(ctx->waste_contents.slots);
+        free(ctx->waste_sites.slots);
+        pandecode_untrack_all(ctx);
+
+        while (ctx->names) {
+                struct pandecode_name_block *next = ctx->names->next;
+                free(ctx->names);
+                ctx->names = next;
+        }
+
+        free(ctx->name_table);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(ctx->frames); ++i) {
+                free(ctx->frames[i].packets);
+                free(ctx->frames[i].data);
+        }
+
+        pandecode_ring_fini(&ctx->dump_ring);
+        pandecode_ring_fini(&ctx->capture_ring);
+        pandecode_ring_fini(&ctx->kept_ring);
+        free(ctx);
+}
+
+void
+pandecode_set_format(struct pandecode_context *ctx, enum pandecode_format format)
+{
+        ctx->format = format;
+}
+
+void
+pandecode_set_backrefs(struct pandecode_context *ctx, bool backrefs)
+{
+        ctx->backrefs = backrefs;
+}
+
+void
+pandecode_set_index(struct pandecode_context *ctx, bool index)
+{
+        ctx->indexing = index;
+}
+
+const struct pandecode_indexed_packet *
+pandecode_indexed_packets(struct pandecode_context *ctx, unsigned *count)
+{
+        *count = ctx->index.count;
+        return ctx->index.packets;
+}
+
+const struct pandecode_indexed_address *
+pandecode_indexed_addresses(struct pandecode_context *ctx, unsigned *count)
+{
+        *count = ctx->index.address_count;
+        return ctx->index.addresses;
+}
+
+uint64_t
+pandecode_output_position(struct pandecode_context *ctx)
+{
+        return agx_sink_position(&ctx->out);
+}
+
+void
+pandecode_set_dump_stream(struct pandecode_context *ctx, FILE *fp)
+{
+        agx_sink_flush(&ctx->out);
+        ctx->dump_stream = fp;
+        ctx->out.fp = fp;
+        ctx->external_stream = (fp != NULL);
+}
+
+static int
+pandecode_compare_va(const void *a, const void *b)
+{
+        const struct pandecode_mapping *x = a, *y = b;
+
+        if (x->gpu_va != y->gpu_va)
+                return x->gpu_va < y->gpu_va ? -1 : 1;
+
+        return (int) x->index - (int) y->index;
+}
+
+/* Mappings never overlap in GPU address space, so the only candidate is the
+ * last one starting at or below the address. Only allocations without a GPU
+ * address share a start, and ties go to the first tracked as before. */
+
+static struct agx_allocation *
+pandecode_find_mapped_gpu_mem_containing_rw(struct pandecode_context *ctx, uint64_t addr)
+{
+        if (!ctx->by_va_valid) {
+                for (unsigned i = 0; i < ctx->mmap_count; ++i) {
+                        ctx->by_va[i] = (struct pandecode_mapping) {
+                                ctx->mmap_array[i].gpu_va, i
+                        };
+                }
+
+                qsort(ctx->by_va, ctx->mmap_count, sizeof(ctx->by_va[0]),
+                      pandecode_compare_va);
+                ctx->by_va_valid = true;
+        }
+
+        unsigned lo = 0, hi = ctx->mmap_count;
+
+        while (lo < hi) {
+                unsigned mid = (lo + hi) / 2;
+
+                if (ctx->by_va[mid].gpu_va <= addr)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        if (lo == 0)
+                return NULL;
+
+        uint64_t start = ctx->by_va[lo - 1].gpu_va;
+
+        while (lo > 1 && ctx->by_va[lo - 2].gpu_va == start)
+                --lo;
+
+        for (unsigned i = lo - 1; i < ctx->mmap_count && ctx->by_va[i].gpu_va == start; ++i) {
+                struct agx_allocation *mem = &ctx->mmap_array[ctx->by_va[i].index];
+
+                if ((addr - start) < mem->size)
+                        return mem;
+        }
+
+        return NULL;
+}
+
+/* Text output resolves addresses to the allocation they point into */
+
+static void
+pandecode_print_address(struct agx_sink *out, struct pandecode_context *ctx, uint64_t va)
+{
+        struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing_rw(ctx, va);
+
+        agx_sink_lit(out, "0x");
+        agx_sink_hex(out, va, 0, false);
+
+        if (mem) {
+                agx_sink_lit(out, " (");
+                agx_sink_puts(out, mem->name);
+                agx_sink_lit(out, " + 0x");
+                agx_sink_hex(out, va - mem->gpu_va, 0, false);
+                agx_sink_putc(out, ')');
+        }
+}
+
+static void
+pandecode_json_address(struct agx_sink *out, struct pandecode_context *ctx, uint64_t va)
+{
+        struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing_rw(ctx, va);
+
+        agx_sink_lit(out, "{\"va\":");
+        agx_sink_u64(out, va);
+
+        if (mem) {
+                agx_sink_lit(out, ",\"bo\":");
+                agx_sink_u64(out, mem->index);
+                agx_sink_lit(out, ",\"offset\":");
+                agx_sink_u64(out, va - mem->gpu_va);
+        }
+
+        agx_sink_putc(out, '}');
+}
+
+struct agx_allocation *
+pandecode_find_mapped_gpu_mem_containing(struct pandecode_context *ctx, uint64_t addr)
+{
+        struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing_rw(ctx, addr);
+
+        if (mem && mem->map && !mem->ro) {
+                mprotect(mem->map, mem->size, PROT_READ);
+                mem->ro = true;
+                ctx->ro_mappings[ctx->ro_mapping_count++] = mem;
+                assert(ctx->ro_mapping_count < MAX_MAPPINGS);
+        }
+
+        return mem;
+}
+
+static inline void *
+__pandecode_fetch_gpu_mem(struct pandecode_context *ctx,
+                          const struct agx_allocation *mem,
+                          uint64_t gpu_va, size_t size,
+                          int line, const char *filename)
+{
+        if (!mem)
+                mem = pandecode_find_mapped_gpu_mem_containing(ctx, gpu_va);
+
+        if (!mem) {
+                fprintf(stderr, "Access to unknown memory %" PRIx64 " in %s:%d\n",
+                        gpu_va, filename, line);
+		agx_sink_flush(&ctx->out);
+		fflush(ctx->dump_stream);
+                assert(0);
+        }
+
+        assert(mem);
+        assert(size + (gpu_va - mem->gpu_va) <= mem->size);
+
+        if (ctx->caching) {
+                struct pandecode_cached_pipeline *entry = ctx->caching;
+
+                if (entry->range_count < PIPELINE_MAX_RANGES)
+                        entry->ranges[entry->range_count++] = (struct pandecode_range) { gpu_va, size };
+                else
+                        entry->overflow = true;
+        }
+
+        return mem->map + gpu_va - mem->gpu_va;
+}
+
+#define pandecode_fetch_gpu_mem(ctx, gpu_va, size) \
+	__pandecode_fetch_gpu_mem(ctx, NULL, gpu_va, size, __LINE__, __FILE__)
+
+/* Records a range of GPU memory the submission reads: command streams,
+ * records, shaders and uniforms. Only these are dumped. */
+
+static void
+pandecode_reach(struct pandecode_context *ctx, uint64_t va, size_t size)
+{
+        if (!size)
+                return;
+
+        if (ctx->reach_count == ctx->reach_capacity) {
+                ctx->reach_capacity = MAX2(ctx->reach_capacity * 2, 256);
+                ctx->reach = realloc(ctx->reach, ctx->reach_capacity * sizeof(*ctx->reach));
+                assert(ctx->reach != NULL);
+        }
+
+        ctx->reach[ctx->reach_count++] = (struct pandecode_range) { va, size };
+}
+
+/* Adds a hash to a set, returning false if it was already there */
+
+static bool
+pandecode_set_insert(struct pandecode_set *set, uint64_t hash)
+{
+        hash = hash ?: 1;
+
+        if ((set->count + 1) * 2 > set->capacity) {
+                struct pandecode_set old = *set;
+
+                set->capacity = MAX2(old.capacity * 2, 1024);
+                set->slots = calloc(set->capacity, sizeof(uint64_t));
+                assert(set->slots != NULL);
+                set->count = 0;
+
+                for (unsigned i = 0; i < old.capacity; ++i) {
+                        if (old.slots[i])
+                                pandecode_set_insert(set, old.slots[i]);
+                }
+
+                free(old.slots);
+        }
+
+        unsigned mask = set->capacity - 1;
+
+        for (unsigned i = hash & mask; ; i = (i + 1) & mask) {
+                if (set->slots[i] == hash)
+                        return false;
+
+                if (!set->slots[i]) {
+                        set->slots[i] = hash;
+                        set->count++;
+                        return true;
+                }
+        }
+}
+
+static void
+pandecode_set_clear(struct pandecode_set *set)
+{
+        if (set->count)
+                memset(set->slots, 0, set->capacity * sizeof(uint64_t));
+
+        set->count = 0;
+}
+
+/* Writes data to dir/<hash>.bin, unless this context or an earlier session
+ * already did. Files are written under a temporary name unique to the
+ * process and context, then renamed, so neither a crash nor concurrent
+ * decoders ever leave a truncated file behind a valid name. */
+
+static void
+pandecode_store(struct pandecode_context *ctx, struct pandecode_set *stored,
+                const char *dir, const void *data, size_t size, uint64_t hash)
+{
+        if (!pandecode_set_insert(stored, hash))
+                return;
+
+        char path[1024], temp[1100];
+        snprintf(path, sizeof(path), "%s/%016" PRIx64 ".bin", dir, hash);
+
+        if (access(path, F_OK) == 0)
+                return;
+
+        snprintf(temp, sizeof(temp), "%s.%d.%p.tmp", path, getpid(), (void *) ctx);
+        FILE *fp = fopen(temp, "wb");
+
+        if (!fp) {
+                fprintf(stderr, "pandecode: failed to open %s\n", temp);
+                return;
+        }
+
+        bool ok = fwrite(data, 1, size, fp) == size;
+        ok &= (fclose(fp) == 0);
+
+        if (!ok || rename(temp, path) != 0) {
+                fprintf(stderr, "pandecode: failed to write %s\n", path);
+                unlink(temp);
+        }
+}
+
+static void
+pandecode_map_read_write(struct pandecode_context *ctx)
+{
+        for (unsigned i = 0; i < ctx->ro_mapping_count; ++i) {
+                ctx->ro_mappings[i]->ro = false;
+                mprotect(ctx->ro_mappings[i]->map, ctx->ro_mappings[i]->size,
+                                PROT_READ | PROT_WRITE);
+        }
+
+        ctx->ro_mapping_count = 0;
+}
+
+/* Helpers for parsing the cmdstream */
+
+#define pandecode_is_text(ctx) ((ctx)->format == PANDECODE_FORMAT_TEXT)
+
+/* Structured formats get one record per packet, carrying the packed bytes
+ * (binary) or the unpacked fields (JSON) */
+
+#define DUMP_UNPACKED(ctx, T, var, map, va, str) { \
+        if ((ctx)->indexing) { \
+                pandecode_index_packet(ctx, AGX_ ## T ## _ID, #T, va); \
+                bl_addresses(T, var, ctx); \
+        } \
+        if (pandecode_is_text(ctx)) { \
+                pandecode_log(ctx, str); \
+                bl_print(&(ctx)->out, T, var, ((ctx)->indent + 1) * 2, ctx); \
+        } else { \
+                pandecode_packet_begin(ctx, AGX_ ## T ## _ID, #T, map, \
+                                       AGX_ ## T ## _LENGTH, va); \
+                if ((ctx)->format == PANDECODE_FORMAT_JSON) \
+                        bl_json(&(ctx)->out, T, var, ctx); \
+                pandecode_packet_end(ctx); \
+        } \
+}
+
+#define DUMP_CL(ctx, T, cl, va, str) {\
+        bl_unpack(cl, T, temp); \
+        DUMP_UNPACKED(ctx, T, temp, cl, va, str "\n"); \
+}
+
+#define pandecode_log(ctx, str) { \
+        if (pandecode_is_text(ctx)) \
+                agx_sink_puts(&(ctx)->out, str); \
+}
+
+#define pandecode_msg(ctx, str) { \
+        if (pandecode_is_text(ctx)) \
+                agx_sink_printf(&(ctx)->out, "// %s", str); \
+}
+
+static void
+pandecode_packet_list_add(struct pandecode_packet_list *list,
+                          struct pandecode_indexed_packet packet)
+{
+        if (list->count == list->capacity) {
+                list->capacity = MAX2(list->capacity * 2, 256);
+                list->packets = realloc(list->packets, list->capacity * sizeof(*list->packets));
+                assert(list->packets != NULL);
+        }
+
+        list->packets[list->count++] = packet;
+}
+
+static void
+pandecode_address_list_add(struct pandecode_packet_list *list,
+                           struct pandecode_indexed_address address)
+{
+        if (list->address_count == list->address_capacity) {
+                list->address_capacity = MAX2(list->address_capacity * 2, 256);
+                list->addresses = realloc(list->addresses,
+                                          list->address_capacity * sizeof(*list->addresses));
+                assert(list->addresses != NULL);
+        }
+
+        list->addresses[list->address_count++] = address;
+}
+
+static void
+pandecode_index_packet(struct pandecode_context *ctx, unsigned id,
+                       const char *type, uint64_t va)
+{
+        if (!ctx->indexing)
+                return;
+
+        /* Pipelines being cached are decoded into a sink of their own */
+        uint64_t base = ctx->caching ? 0 : ctx->index_base;
+
+        pandecode_packet_list_add(ctx->caching ? &ctx->cache_index : &ctx->index,
+                (struct pandecode_indexed_packet) {
+                        .va = va,
+                        .type = type,
+                        .id = id,
+                        .offset = agx_sink_position(&ctx->out) - base,
+                        .encoder = ctx->encoder_count,
+                });
+}
+
+/* Address fields of the packet just indexed, null addresses skipped */
+
+static void
+pandecode_index_address(struct pandecode_context *ctx, const char *field, uint64_t va)
+{
+        struct pandecode_packet_list *list = ctx->caching ? &ctx->cache_index : &ctx->index;
+
+        if (!va)
+                return;
+
+        assert(list->count > 0);
+        pandecode_address_list_add(list, (struct pandecode_indexed_address) {
+                .va = va,
+                .field = field,
+                .packet = list->count - 1,
+        });
+}
+
+/* Bytes referenced by an address field of the packet just indexed, for the
+ * fields whose extent the decoder works out */
+
+static void
+pandecode_index_extent(struct pandecode_context *ctx, uint64_t va, uint64_t size)
+{
+        struct pandecode_packet_list *list = ctx->caching ? &ctx->cache_index : &ctx->index;
+
+        if (!ctx->indexing || !list->count)
+                return;
+
+        for (unsigned i = list->address_count; i-- > 0; ) {
+                struct pandecode_indexed_address *address = &list->addresses[i];
+
+                if (address->packet != list->count - 1)
+                        break;
+
+                if (address->va == va)
+                        address->size = size;
+        }
+}
+
+/* Indexes the packets of cached text about to be written to the output */
+
+static void
+pandecode_index_replay(struct pandecode_context *ctx,
+                       const struct pandecode_indexed_packet *packets,
+                       unsigned count,
+                       const struct pandecode_indexed_address *addresses,
+                       unsigned address_count)
+{
+        uint64_t start = agx_sink_position(&ctx->out) - ctx->index_base;
+        unsigned first = ctx->index.count;
+
+        for (unsigned i = 0; i < count; ++i) {
+                struct pandecode_indexed_packet packet = packets[i];
+                packet.offset += start;
+                packet.encoder = ctx->encoder_count;
+                pandecode_packet_list_add(&ctx->index, packet);
+        }
+
+        for (unsigned i = 0; i < address_count; ++i) {
+                struct pandecode_indexed_address address = addresses[i];
+                address.packet += first;
+                pandecode_address_list_add(&ctx->index, address);
+        }
+}
+
+static void
+pandecode_delta_record(struct pandecode_context *ctx, unsigned id,
+                       const char *type, const uint8_t *map, size_t size,
+                       uint64_t va)
+{
+        struct pandecode_frame *frame = &ctx->frames[ctx->current_frame];
+
+        if (frame->count == frame->capacity) {
+                frame->capacity = MAX2(frame->capacity * 2, 256);
+                frame->packets = realloc(frame->packets, frame->capacity * sizeof(*frame->packets));
+                assert(frame->packets != NULL);
+        }
+
+        if (frame->data_size + size > frame->data_capacity) {
+                frame->data_capacity = MAX2(frame->data_capacity * 2, frame->data_size + size);
+                frame->data = realloc(frame->data, frame->data_capacity);
+                assert(frame->data != NULL);
+        }
+
+        frame->packets[frame->count++] = (struct pandecode_packet) {
+                .id = id,
+                .type = type,
+                .va = va,
+                .size = size,
+                .offset = frame->data_size,
+        };
+
+        memcpy(frame->data + frame->data_size, map, size);
+        frame->data_size += size;
+}
+
+static void
+pandecode_packet_begin(struct pandecode_context *ctx, unsigned id,
+                       const char *type, const uint8_t *map, size_t size,
+                       uint64_t va)
+{
+        if (ctx->format == PANDECODE_FORMAT_STATS) {
+                ctx->stats.draws += (id == AGX_DRAW_ID);
+                ctx->stats.launches += (id == AGX_LAUNCH_ID);
+                ctx->stats.pipeline_binds += (id == AGX_BIND_PIPELINE_ID);
+                ctx->stats.uniform_binds += (id == AGX_BIND_UNIFORM_ID);
+        } else if (ctx->format == PANDECODE_FORMAT_WASTE) {
+                /* Counted by the dispatch, see pandecode_waste_upload */
+        } else if (ctx->format == PANDECODE_FORMAT_DELTA) {
+                pandecode_delta_record(ctx, id, type, map, size, va);
+        } else if (ctx->format == PANDECODE_FORMAT_BINARY) {
+                struct pandecode_packet_record rec = {
+                        .type = id,
+                        .size = size,
+                        .frame = ctx->dump_frame_count,
+                        .va = va,
+                };
+
+                agx_sink_write(&ctx->out, &rec, sizeof(rec));
+                agx_sink_write(&ctx->out, map, size);
+        } else {
+                agx_sink_lit(&ctx->out, "{\"frame\":");
+                agx_sink_i64(&ctx->out, ctx->dump_frame_count);
+                agx_sink_lit(&ctx->out, ",\"va\":");
+                agx_sink_u64(&ctx->out, va);
+                agx_sink_lit(&ctx->out, ",\"type\":\"");
+                agx_sink_puts(&ctx->out, type);
+                agx_sink_lit(&ctx->out, "\",\"size\":");
+                agx_sink_u64(&ctx->out, size);
+
+                if (id != PANDECODE_PACKET_UNKNOWN)
+                        agx_sink_lit(&ctx->out, ",\"fields\":");
+        }
+}
+
+static void
+pandecode_packet_end(struct pandecode_context *ctx)
+{
+        if (ctx->format == PANDECODE_FORMAT_JSON)
+                agx_sink_lit(&ctx->out, "}\n");
+}
+
+/* Undecoded bytes, a hexdump in text mode. Unknown records are labelled with
+ * their address, after indexing so the index points at the label. */
+
+static void
+pandecode_unknown(struct pandecode_context *ctx, const uint8_t *map, size_t size,
+                  uint64_t va, bool record)
+{
+        pandecode_index_packet(ctx, PANDECODE_PACKET_UNKNOWN, "UNKNOWN", va);
+
+        if (pandecode_is_text(ctx)) {
+                if (record)
+                        agx_sink_printf(&ctx->out, "Record %" PRIx64 "\n", va);
+
+                hexdump_sink(&ctx->out, map, size, false);
+        } else {
+                pandecode_packet_begin(ctx, PANDECODE_PACKET_UNKNOWN, "UNKNOWN",
+                                       map, size, va);
+                pandecode_packet_end(ctx);
+        }
+}
+
+/* To check for memory safety issues, validates that the given pointer in GPU
+ * memory is valid, containing at least sz bytes. The goal is to detect
+ * GPU-side memory bugs (NULL pointer dereferences, buffer overflows, or buffer
+ * overruns) by statically validating pointers.
+ */
+
+static void
+pandecode_validate_buffer(struct pandecode_context *ctx, uint64_t addr, size_t sz)
+{
+        if (!addr) {
+                pandecode_msg(ctx, "XXX: null pointer deref");
+                return;
+        }
+
+        /* Find a BO */
+
+        struct agx_allocation *bo =
+                pandecode_find_mapped_gpu_mem_containing(ctx, addr);
+
+        if (!bo) {
+                pandecode_msg(ctx, "XXX: invalid memory dereference\n");
+                return;
+        }
+
+        /* Bounds check */
+
+        unsigned offset = addr - bo->gpu_va;
+        unsigned total = offset + sz;
+
+        if (total > bo->size) {
+                agx_sink_printf(&ctx->out, "// XXX: buffer overrun. "
+                                "Chunk of size %zu at offset %d in buffer of size %zu. "
+                                "Overrun by %zu bytes. \n",
+                                sz, offset, bo->size, total - bo->size);
+                return;
+        }
+}
+
+static struct agx_allocation *
+pandecode_find_cmdbuf(struct pandecode_context *ctx, unsigned cmdbuf_index)
+{
+	for (unsigned i = 0; i < ctx->mmap_count; ++i) {
+		if (ctx->mmap_array[i].type != AGX_ALLOC_CMDBUF)
+			continue;
+
+		if (ctx->mmap_array[i].index != cmdbuf_index)
+			continue;
+
+		return &ctx->mmap_array[i];
+	}
+
+	return NULL;
+}
+
+static void
+pandecode_dump_bo(struct pandecode_context *ctx, struct agx_allocation *bo, const char *name)
+{
+	if (!pandecode_is_text(ctx))
+		return;
+
+	agx_sink_printf(&ctx->out, "%s %s (%u)\n", name, bo->name ?: "", bo->index);
+	hexdump_sink(&ctx->out, bo->map, bo->size, false);
+}
+
+/* Abstraction for command stream parsing */
+typedef unsigned (*decode_cmd)(struct pandecode_context *ctx, const uint8_t *map, uint64_t va, bool verbose);
+
+#define STATE_DONE (0xFFFFFFFFu)
+
+/* Returns the offset of the terminator, or of the end of the BO if there was
+ * none */
+
+static size_t
+pandecode_stateful(struct pandecode_context *ctx, uint64_t va, const char *label, decode_cmd decoder, bool verbose)
+{
+	struct agx_allocation *alloc = pandecode_find_mapped_gpu_mem_containing(ctx, va);
+	assert(alloc != NULL && "nonexistant object");
+
+	if (pandecode_is_text(ctx)) {
+		agx_sink_puts(&ctx->out, label);
+		agx_sink_putc(&ctx->out, '\n');
+	}
+
+	uint8_t *start = pandecode_fetch_gpu_mem(ctx, va, 64);
+	uint8_t *map = start;
+	uint8_t *end = map + alloc->size;
+
+	if (verbose)
+		pandecode_dump_bo(ctx, alloc, label);
+
+	 while (map < end) {
+		 unsigned count = decoder(ctx, map, va + (map - start), verbose);
+
+		 if (count == STATE_DONE)
+			 break;
+
+		 /* If we fail to decode, default to a hexdump (don't hang) */
+		 if (count == 0) {
+			pandecode_unknown(ctx, map, 8, va + (map - start), false);
+			count = 8;
+		 }
+
+		 map += count;
+	 }
+
+	 ctx->stats.bytes[alloc->type] += map - start;
+	 pandecode_reach(ctx, va, map - start);
+	 return map - start;
+}
+
+/* Redundancy analysis for the waste format. An upload is wasted if the same
+ * bytes were already uploaded at another address this cmdstream, so binding
+ * one buffer from many places costs nothing but copying it does. Returns the
+ * hash of the contents, or 0 if they are not mapped. */
+
+static uint64_t
+pandecode_waste_upload(struct pandecode_context *ctx, enum pandecode_waste_class cls,
+                       uint64_t va, size_t size)
+{
+        if (ctx->format != PANDECODE_FORMAT_WASTE)
+                return 0;
+
+        struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing(ctx, va);
+
+        if (!mem || (va - mem->gpu_va) + size > mem->size)
+                return 0;
+
+        uint64_t contents = agx_hash(mem->map + (va - mem->gpu_va), size, cls);
+        uint64_t site[2] = { contents, va };
+
+        if (pandecode_set_insert(&ctx->waste_sites, agx_hash(site, sizeof(site), 0)) &&
+            !pandecode_set_insert(&ctx->waste_contents, contents)) {
+                ctx->waste[cls].packets++;
+                ctx->waste[cls].bytes += size;
+        }
+
+        return contents;
+}
+
+/* Binds state with the given contents to an encoder slot, counting the
+ * packet as wasted if the slot already held the same. Returns whether it
+ * did. */
+
+static bool
+pandecode_waste_bind(struct pandecode_context *ctx, enum pandecode_waste_slot slot,
+                     uint64_t contents, size_t size)
+{
+        if (ctx->format != PANDECODE_FORMAT_WASTE)
+                return false;
+
+        /* Zero marks a slot nothing was bound to yet */
+        contents = contents ?: 1;
+
+        if (ctx->waste_bound[slot] != contents) {
+                ctx->waste_bound[slot] = contents;
+                return false;
+        }
+
+        enum pandecode_waste_class cls = slot <= WASTE_SLOT_FRAGMENT_PIPELINE ?
+                WASTE_PIPELINE_REBINDS : WASTE_STATE_RECORDS;
+
+        ctx->waste[cls].packets++;
+        ctx->waste[cls].bytes += size;
+        return true;
+}
+
+/* Records set state, so one that sets nothing new is wasted whole. Otherwise
+ * it may still be a copy of one uploaded before. */
+
+static void
+pandecode_waste_record(struct pandecode_context *ctx, enum pandecode_waste_slot slot,
+                       uint64_t contents, uint64_t va, size_t size)
+{
+        if (!pandecode_waste_bind(ctx, slot, contents, AGX_RECORD_LENGTH + size))
+                pandecode_waste_upload(ctx, WASTE_RECORD_UPLOADS, va, size);
+}
+
+static void
+pandecode_waste_emit(struct pandecode_context *ctx)
+{
+        struct pandecode_waste_count total = { 0 };
+
+        for (unsigned i = 0; i < WASTE_NUM_CLASSES; ++i) {
+                total.packets += ctx->waste[i].packets;
+                total.bytes += ctx->waste[i].bytes;
+        }
+
+        agx_sink_lit(&ctx->out, "frame ");
+        agx_sink_i64(&ctx->out, ctx->dump_frame_count);
+        agx_sink_lit(&ctx->out, ": wasted ");
+        agx_sink_u64(&ctx->out, total.packets);
+        agx_sink_lit(&ctx->out, " packets ");
+        agx_sink_u64(&ctx->out, total.bytes);
+        agx_sink_lit(&ctx->out, " bytes");
+
+        for (unsigned i = 0; i < WASTE_NUM_CLASSES; ++i) {
+                agx_sink_lit(&ctx->out, ", ");
+                agx_sink_puts(&ctx->out, pandecode_waste_names[i]);
+                agx_sink_putc(&ctx->out, ' ');
+                agx_sink_u64(&ctx->out, ctx->waste[i].packets);
+                agx_sink_lit(&ctx->out, " (");
+                agx_sink_u64(&ctx->out, ctx->waste[i].bytes);
+                agx_sink_lit(&ctx->out, " bytes)");
+        }
+
+        agx_sink_putc(&ctx->out, '\n');
+}
+
+/* With PANDECODE_SHADER_STORE set, every shader binary is stored once in
+ * that directory by content hash, and an index file there lists the
+ * pipelines and frames using each */
+
+static bool
+pandecode_shader_store_open(struct pandecode_context *ctx)
+{
+	if (ctx->shader_store_checked)
+		return ctx->shader_index != NULL;
+
+	ctx->shader_store_checked = true;
+	ctx->shader_store = getenv("PANDECODE_SHADER_STORE");
+
+	if (!ctx->shader_store)
+		return false;
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/index", ctx->shader_store);
+
+	if (mkdir(ctx->shader_store, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "pandecode: failed to create %s\n", ctx->shader_store);
+		return false;
+	}
+
+	/* Line buffered, so concurrent decoders append whole lines */
+	ctx->shader_index = fopen(path, "a");
+
+	if (!ctx->shader_index) {
+		fprintf(stderr, "pandecode: failed to open %s\n", path);
+		return false;
+	}
+
+	setvbuf(ctx->shader_index, NULL, _IOLBF, 0);
+	return true;
+}
+
+static void
+pandecode_shader_use(struct pandecode_context *ctx, const struct pandecode_shader_use *use)
+{
+	uint64_t key[2] = { use->hash, ctx->pipeline_va };
+
+	if (!pandecode_set_insert(&ctx->shader_uses, agx_hash(key, sizeof(key), 0)))
+		return;
+
+	fprintf(ctx->shader_index, "frame %d pipeline %" PRIx64 " %s %016" PRIx64 ".bin size %zu\n",
+		ctx->dump_frame_count, ctx->pipeline_va,
+		use->preshader ? "preshader" : "shader", use->hash, use->size);
+}
+
+/* Returns the size of the shader, or zero if it is not mapped */
+
+static size_t
+pandecode_shader(struct pandecode_context *ctx, uint64_t va, bool preshader)
+{
+	struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing(ctx, va);
+
+	if (!mem) {
+		fprintf(stderr, "pandecode: shader at unknown address %" PRIx64 "\n", va);
+		return 0;
+	}
+
+	/* Shaders are as long as they are, up to the end of their BO */
+	bool stop;
+	size_t size = agx_shader_size((uint8_t *) mem->map + (va - mem->gpu_va),
+				      mem->size - (va - mem->gpu_va), &stop);
+
+	if (!stop)
+		fprintf(stderr, "pandecode: no stop instruction in shader at %" PRIx64 "\n", va);
+
+	uint8_t *code = pandecode_fetch_gpu_mem(ctx, va, size);
+
+	pandecode_index_extent(ctx, va, size);
+	ctx->stats.shader_bytes += size;
+	ctx->stats.bytes[mem->type] += size;
+	pandecode_reach(ctx, va, size);
+	pandecode_waste_upload(ctx, WASTE_SHADER_UPLOADS, va, size);
+
+	if (!pandecode_shader_store_open(ctx))
+		return size;
+
+	struct pandecode_shader_use use = {
+		.hash = agx_hash(code, size, 0),
+		.size = size,
+		.preshader = preshader,
+	};
+
+	pandecode_store(ctx, &ctx->shaders_stored, ctx->shader_store, code, size, use.hash);
+	pandecode_shader_use(ctx, &use);
+
+	if (ctx->caching) {
+		struct pandecode_cached_pipeline *entry = ctx->caching;
+
+		if (entry->shader_count < PIPELINE_MAX_SHADERS)
+			entry->shaders[entry->shader_count++] = use;
+		else
+			entry->overflow = true;
+	}
+
+	return size;
+}
+
+static unsigned
+pandecode_pipeline(struct pandecode_context *ctx, const uint8_t *map, uint64_t va, UNUSED bool verbose)
+{
+	uint8_t zeroes[16] = { 0 };
+	unsigned length;
+	unsigned type = agx_match_pipeline(map, &length);
+
+	if (type == AGX_SET_SHADER_EXTENDED_ID) {
+		bl_unpack(map, SET_SHADER_EXTENDED, cmd);
+		DUMP_UNPACKED(ctx, SET_SHADER_EXTENDED, cmd, map, va, "Set shader\n");
+
+		size_t code_size = pandecode_shader(ctx, cmd.code, false);
+		size_t preshader_size = 0;
+
+		if (cmd.preshader_mode == AGX_PRESHADER_MODE_PRESHADER)
+			preshader_size = pandecode_shader(ctx, cmd.preshader_code, true);
+
+		if (!pandecode_is_text(ctx))
+			return length;
+
+		if (preshader_size) {
+			pandecode_log(ctx, "Preshader\n");
+			agx_disassemble_sink(pandecode_fetch_gpu_mem(ctx, cmd.preshader_code, preshader_size),
+				preshader_size, &ctx->out);
+			pandecode_log(ctx, "\n---\n");
+		}
+
+		pandecode_log(ctx, "\n");
+
+		if (code_size) {
+			agx_disassemble_sink(pandecode_fetch_gpu_mem(ctx, cmd.code, code_size),
+				code_size, &ctx->out);
+		}
+
+		pandecode_log(ctx, "\n");
+
+		return length;
+	} else if (type == AGX_SET_SHADER_ID) {
+		bl_unpack(map, SET_SHADER, cmd);
+		DUMP_UNPACKED(ctx, SET_SHADER, cmd, map, va, "Set shader\n");
+
+		size_t code_size = pandecode_shader(ctx, cmd.code, false);
+		size_t preshader_size = 0;
+
+		if (cmd.preshader_mode == AGX_PRESHADER_MODE_PRESHADER)
+			preshader_size = pandecode_shader(ctx, cmd.preshader_code, true);
+
+		if (!pandecode_is_text(ctx))
+			return length;
+
+		if (preshader_size) {
+			pandecode_log(ctx, "Preshader\n");
+			agx_disassemble_sink(pandecode_fetch_gpu_mem(ctx, cmd.preshader_code, preshader_size),
+				preshader_size, &ctx->out);
+			pandecode_log(ctx, "\n---\n");
+		}
+
+		pandecode_log(ctx, "\n");
+
+		if (code_size) {
+			agx_disassemble_sink(pandecode_fetch_gpu_mem(ctx, cmd.code, code_size),
+				code_size, &ctx->out);
+		}
+
+		pandecode_log(ctx, "\n");
+
+		return length;
+	} else if (type == AGX_BIND_UNIFORM_ID) {
+		bl_unpack(map, BIND_UNIFORM, cmd);
+		DUMP_UNPACKED(ctx, BIND_UNIFORM, cmd, map, va, "Bind uniform\n");
+		pandecode_index_extent(ctx, cmd.buffer, cmd.size_halfs * 2);
+		pandecode_reach(ctx, cmd.buffer, cmd.size_halfs * 2);
+		pandecode_waste_upload(ctx, WASTE_UNIFORM_UPLOADS, cmd.buffer, cmd.size_halfs * 2);
+		return length;
+	} else if (type == AGX_PIPELINE_END_ID && memcmp(map, zeroes, sizeof(zeroes)) == 0) {
+		/* TODO: Termination */
+		pandecode_reach(ctx, va, length);
+		return STATE_DONE;
+	} else {
+		return 0;
+	}
+}
+
+/* Hashes everything a cached pipeline decode read, failing if any of it is no
+ * longer mapped */
+
+static bool
+pandecode_hash_ranges(struct pandecode_context *ctx,
+                      const struct pandecode_cached_pipeline *entry,
+                      uint64_t *hash)
+{
+        *hash = entry->va;
+
+        for (unsigned i = 0; i < entry->range_count; ++i) {
+                const struct pandecode_range *r = &entry->ranges[i];
+                struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing(ctx, r->va);
+
+                if (!mem || (r->va - mem->gpu_va) + r->size > mem->size)
+                        return false;
+
+                *hash = agx_hash(mem->map + (r->va - mem->gpu_va), r->size, *hash);
+        }
+
+        /* The text names the allocations addresses point into, which may
+         * change under the same bytes. Names are interned, so hash pointers. */
+        for (unsigned i = 0; i < entry->reach_count; ++i) {
+                struct agx_allocation *mem =
+                        pandecode_find_mapped_gpu_mem_containing_rw(ctx, entry->reach[i].va);
+                const char *name = mem ? mem->name : NULL;
+
+                *hash = agx_hash(&name, sizeof(name), *hash);
+        }
+
+        return true;
+}
+
+static void
+pandecode_pipeline_cached(struct pandecode_context *ctx, uint64_t va, bool verbose)
+{
+        /* Verbose decodes dump whole BOs and structured formats carry the
+         * frame in every record, so only plain text is cached */
+        ctx->pipeline_va = va;
+
+        if (verbose || !pandecode_is_text(ctx)) {
+                size_t end = pandecode_stateful(ctx, va, "Pipeline", pandecode_pipeline, verbose);
+                ctx->waste_pipeline = pandecode_waste_upload(ctx, WASTE_PIPELINE_UPLOADS, va, end);
+                return;
+        }
+
+        struct pandecode_cached_pipeline *entry =
+                &ctx->pipeline_cache[(va >> 6) % PIPELINE_CACHE_SIZE];
+        uint64_t hash;
+
+        if (entry->text && entry->va == va &&
+            pandecode_hash_ranges(ctx, entry, &hash) && hash == entry->hash) {
+                for (unsigned i = 0; i < entry->reach_count; ++i)
+                        pandecode_reach(ctx, entry->reach[i].va, entry->reach[i].size);
+
+                for (unsigned i = 0; i < entry->shader_count; ++i)
+                        pandecode_shader_use(ctx, &entry->shaders[i]);
+
+                if (ctx->backrefs) {
+                        agx_sink_printf(&ctx->out, "Pipeline %" PRIx64 " unchanged since frame %d\n\n",
+                                        va, entry->frame);
+                } else {
+                        pandecode_index_replay(ctx, entry->packets, entry->packet_count,
+                                               entry->addresses, entry->address_count);
+                        agx_sink_write(&ctx->out, entry->text, entry->text_len);
+                }
+
+                return;
+        }
+
+        /* Miss, so decode into memory, recording every range read */
+        free(entry->text);
+        free(entry->reach);
+        free(entry->packets);
+        free(entry->addresses);
+        *entry = (struct pandecode_cached_pipeline) {
+                .va = va,
+                .frame = ctx->dump_frame_count,
+        };
+
+        unsigned reach_start = ctx->reach_count;
+
+        struct agx_sink out = ctx->out;
+        agx_sink_init_memory(&ctx->out);
+        ctx->caching = entry;
+        ctx->cache_index.count = 0;
+        ctx->cache_index.address_count = 0;
+
+        size_t end = pandecode_stateful(ctx, va, "Pipeline", pandecode_pipeline, verbose);
+
+        ctx->caching = NULL;
+        struct agx_sink text = ctx->out;
+        ctx->out = out;
+        pandecode_index_replay(ctx, ctx->cache_index.packets, ctx->cache_index.count,
+                               ctx->cache_index.addresses, ctx->cache_index.address_count);
+        agx_sink_write(&ctx->out, text.buf, text.len);
+
+        /* The walk reads up to and including 16 bytes of terminating zeroes */
+        struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing(ctx, va);
+        size_t size = MIN2(end + 16, mem->size - (va - mem->gpu_va));
+
+        if (entry->overflow || entry->range_count == PIPELINE_MAX_RANGES) {
+                free(text.buf);
+                return;
+        }
+
+        entry->ranges[entry->range_count++] = (struct pandecode_range) { va, size };
+        entry->text = text.buf;
+        entry->text_len = text.len;
+
+        entry->reach_count = ctx->reach_count - reach_start;
+        entry->reach = malloc(entry->reach_count * sizeof(*entry->reach));
+        assert(entry->reach != NULL || !entry->reach_count);
+        memcpy(entry->reach, ctx->reach + reach_start, entry->reach_count * sizeof(*entry->reach));
+
+        if (ctx->cache_index.count) {
+                size_t packets_size = ctx->cache_index.count * sizeof(*entry->packets);
+                entry->packets = malloc(packets_size);
+                assert(entry->packets != NULL);
+                memcpy(entry->packets, ctx->cache_index.packets, packets_size);
+                entry->packet_count = ctx->cache_index.count;
+        }
+
+        if (ctx->cache_index.address_count) {
+                size_t addresses_size = ctx->cache_index.address_count * sizeof(*entry->addresses);
+                entry->addresses = malloc(addresses_size);
+                assert(entry->addresses != NULL);
+                memcpy(entry->addresses, ctx->cache_index.addresses, addresses_size);
+                entry->address_count = ctx->cache_index.address_count;
+        }
+
+        UNUSED bool mapped = pandecode_hash_ranges(ctx, entry, &entry->hash);
+        assert(mapped);
+}
+
+static void
+pandecode_record(struct pandecode_context *ctx, uint64_t va, size_t size, bool verbose)
+{
+	uint8_t *map = pandecode_fetch_gpu_mem(ctx, va, size);
+	unsigned length;
+	unsigned type = agx_match_record(map, &length);
+
+	if (type == AGX_VIEWPORT_ID) {
+		assert(size == AGX_VIEWPORT_LENGTH);
+		DUMP_CL(ctx, VIEWPORT, map, va, "Viewport");
+		pandecode_waste_record(ctx, WASTE_SLOT_VIEWPORT, agx_hash(map, size, 0), va, size);
+	} else if (type == AGX_LINKAGE_ID) {
+		assert(size == AGX_LINKAGE_LENGTH);
+		DUMP_CL(ctx, LINKAGE, map, va, "Linkage");
+		pandecode_waste_record(ctx, WASTE_SLOT_LINKAGE, agx_hash(map, size, 0), va, size);
+	} else if (type == AGX_BIND_PIPELINE_ID) {
+		assert(size == (AGX_BIND_PIPELINE_LENGTH + 4));
+//		XXX: why does this raise a bus error?
+//		uint32_t unk = 0;
+//		memcpy(map + AGX_BIND_PIPELINE_LENGTH, &unk, 4);
+
+		 bl_unpack(map, BIND_PIPELINE, cmd);
+		 pandecode_pipeline_cached(ctx, cmd.pipeline, verbose);
+		 DUMP_UNPACKED(ctx, BIND_PIPELINE, cmd, map, va, "Bind fragment pipeline\n");
+		 pandecode_waste_record(ctx, WASTE_SLOT_FRAGMENT_PIPELINE, ctx->waste_pipeline, va, size);
+//		 fprintf(ctx->dump_stream, "Unk: %X\n", unk);
+	} else {
+		pandecode_unknown(ctx, map, size, va, true);
+		pandecode_waste_upload(ctx, WASTE_RECORD_UPLOADS, va, size);
+	}
+}
+
+/* Names of the packets a scan finds, as DUMP_UNPACKED indexes them */
+
+static const char *pandecode_cmd_names[] = {
+	[AGX_VIEWPORT_ID] = "VIEWPORT",
+	[AGX_LINKAGE_ID] = "LINKAGE",
+	[AGX_BIND_PIPELINE_ID] = "BIND_PIPELINE",
+	[AGX_RECORD_ID] = "RECORD",
+	[AGX_DRAW_ID] = "DRAW",
+	[AGX_LAUNCH_ID] = "LAUNCH",
+};
+
+static unsigned
+pandecode_cmd(struct pandecode_context *ctx, const uint8_t *map, uint64_t va, bool verbose)
+{
+	unsigned length;
+	unsigned type = agx_match_cmd(map, &length);
+
+	if (type == AGX_LAUNCH_ID) {
+		 bl_unpack(map, LAUNCH, cmd);
+		 pandecode_pipeline_cached(ctx, cmd.pipeline, verbose);
+		 DUMP_UNPACKED(ctx, LAUNCH, cmd, map, va, "Launch\n");
+	} else if (type == AGX_BIND_PIPELINE_ID) {
+		 bl_unpack(map, BIND_PIPELINE, cmd);
+		 pandecode_pipeline_cached(ctx, cmd.pipeline, verbose);
+		 DUMP_UNPACKED(ctx, BIND_PIPELINE, cmd, map, va, "Bind vertex pipeline\n");
+		 pandecode_waste_bind(ctx, WASTE_SLOT_VERTEX_PIPELINE, ctx->waste_pipeline, length);
+
+		 assert(map[AGX_BIND_PIPELINE_LENGTH] == 0);
+	} else if (type == AGX_DRAW_ID) {
+		 DUMP_CL(ctx, DRAW, map, va, "Draw");
+	} else if (type == AGX_RECORD_ID) {
+		/* No need to explicitly dump the record */
+		 bl_unpack(map, RECORD, cmd);
+		 struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing(ctx, cmd.data);
+
+		 if (mem) {
+			 ctx->stats.records++;
+			 ctx->stats.bytes[mem->type] += cmd.size_words * 4;
+			 pandecode_reach(ctx, cmd.data, cmd.size_words * 4);
+			 pandecode_record(ctx, cmd.data, cmd.size_words * 4, verbose);
+		 }
+		 else {
+			 DUMP_UNPACKED(ctx, RECORD, cmd, map, va, "Non-existant record (XXX)\n");
+			 pandecode_index_extent(ctx, cmd.data, cmd.size_words * 4);
+		 }
+	} else if (type == AGX_STOP_ID) {
+		pandecode_reach(ctx, va, length);
+		return STATE_DONE;
+	} else if (type == AGX_STOP_PADDED_ID) {
+		unsigned zero[16] = { 0 };
+		assert(memcmp(map + 4, zero, sizeof(zero)) == 0);
+		pandecode_reach(ctx, va, length);
+		return STATE_DONE;
+	} else {
+		return 0;
+	}
+
+	return length;
+}
+
+/* First phase of a two-phase decode, see pandecode_scan. Mirrors the walk of
+ * pandecode_stateful with pandecode_cmd, looking only at command headers and
+ * the first word of each record. */
+
+static void
+pandecode_scan_encoder(struct pandecode_context *ctx, uint64_t va, unsigned encoder)
+{
+	struct agx_allocation *alloc = pandecode_find_mapped_gpu_mem_containing(ctx, va);
+	assert(alloc != NULL && "nonexistant object");
+
+	const uint8_t *start = pandecode_fetch_gpu_mem(ctx, va, 64);
+	const uint8_t *end = start + alloc->size;
+
+	/* Records tend to come from one BO, so check the last first */
+	struct agx_allocation *mem = NULL;
+
+	for (const uint8_t *map = start; map < end; ) {
+		unsigned length;
+		unsigned type = agx_match_cmd(map, &length);
+		bool record = false;
+
+		if (type == AGX_STOP_ID || type == AGX_STOP_PADDED_ID)
+			break;
+
+		/* Undecodable commands are skipped 8 bytes at a time */
+		if (type == AGX_NO_MATCH)
+			length = 8;
+
+		if (type == AGX_RECORD_ID) {
+			bl_unpack(map, RECORD, cmd);
+
+			if (!mem || cmd.data < mem->gpu_va || cmd.data - mem->gpu_va >= mem->size)
+				mem = pandecode_find_mapped_gpu_mem_containing(ctx, cmd.data);
+
+			if (mem && cmd.data - mem->gpu_va + 4 <= mem->size) {
+				unsigned record_length;
+				type = agx_match_record(mem->map + (cmd.data - mem->gpu_va),
+							&record_length);
+				record = true;
+			}
+		}
+
+		if (type == AGX_NO_MATCH)
+			type = PANDECODE_PACKET_UNKNOWN;
+
+		if (ctx->scan_count == ctx->scan_capacity) {
+			ctx->scan_capacity = MAX2(ctx->scan_capacity * 2, 256);
+			ctx->scan = realloc(ctx->scan, ctx->scan_capacity * sizeof(*ctx->scan));
+			assert(ctx->scan != NULL);
+		}
+
+		ctx->scan[ctx->scan_count++] = (struct pandecode_scanned_packet) {
+			.va = va + (map - start),
+			.type = type < ARRAY_SIZE(pandecode_cmd_names) ?
+				pandecode_cmd_names[type] : "UNKNOWN",
+			.id = type,
+			.encoder = encoder,
+			.record = record,
+		};
+
+		map += length;
+	}
+}
+
+/* Delta output compares the packets of this frame to the previous one. The
+ * common prefix and suffix of packet types are paired up and printed only if
+ * their contents changed, at field granularity. Anything between is printed
+ * as removed and added, so a steady state stream prints next to nothing. */
+
+static bool
+pandecode_packet_equal(const struct pandecode_frame *a, const struct pandecode_packet *pa,
+                       const struct pandecode_frame *b, const struct pandecode_packet *pb)
+{
+        return pa->size == pb->size &&
+               !memcmp(a->data + pa->offset, b->data + pb->offset, pa->size);
+}
+
+static void
+pandecode_delta_print(struct pandecode_context *ctx, char op, unsigned index,
+                      const struct pandecode_packet *p)
+{
+        agx_sink_putc(&ctx->out, op);
+        agx_sink_putc(&ctx->out, ' ');
+        agx_sink_puts(&ctx->out, p->type);
+        agx_sink_lit(&ctx->out, " #");
+        agx_sink_u64(&ctx->out, index);
+        agx_sink_lit(&ctx->out, " @ ");
+        agx_sink_hex(&ctx->out, p->va, 0, false);
+        agx_sink_putc(&ctx->out, '\n');
+}
+
+static void
+pandecode_delta_emit(struct pandecode_context *ctx)
+{
+        struct pandecode_frame *new = &ctx->frames[ctx->current_frame];
+        struct pandecode_frame *old = &ctx->frames[!ctx->current_frame];
+        unsigned prefix = 0, suffix = 0, changed = 0;
+
+        while (prefix < old->count && prefix < new->count &&
+               old->packets[prefix].id == new->packets[prefix].id)
+                prefix++;
+
+        while (suffix < (old->count - prefix) && suffix < (new->count - prefix) &&
+               old->packets[old->count - 1 - suffix].id == new->packets[new->count - 1 - suffix].id)
+                suffix++;
+
+        unsigned removed = old->count - prefix - suffix;
+        unsigned added = new->count - prefix - suffix;
+
+        for (unsigned i = 0; i < new->count; ++i) {
+                bool paired = (i < prefix) || (i >= new->count - suffix);
+                unsigned j = (i < prefix) ? i : i - new->count + old->count;
+
+                if (paired && pandecode_packet_equal(old, &old->packets[j], new, &new->packets[i]))
+                        continue;
+
+                changed += paired;
+        }
+
+        agx_sink_printf(&ctx->out, "Frame %d: %u changed, %u added, %u removed of %u packets\n",
+                        ctx->dump_frame_count, changed, added, removed, new->count);
+
+        for (unsigned i = prefix; i < old->count - suffix; ++i)
+                pandecode_delta_print(ctx, '-', i, &old->packets[i]);
+
+        for (unsigned i = 0; i < new->count; ++i) {
+                const struct pandecode_packet *p = &new->packets[i];
+                const uint8_t *cl = new->data + p->offset;
+                bool paired = (i < prefix) || (i >= new->count - suffix);
+                unsigned j = (i < prefix) ? i : i - new->count + old->count;
+
+                if (paired) {
+                        const struct pandecode_packet *q = &old->packets[j];
+
+                        if (pandecode_packet_equal(old, q, new, p))
+                                continue;
+
+                        pandecode_delta_print(ctx, '~', i, p);
+
+                        if (p->id == PANDECODE_PACKET_UNKNOWN || p->size != q->size)
+                                hexdump_sink(&ctx->out, cl, p->size, false);
+                        else
+                                agx_diff_packed(&ctx->out, p->id, old->data + q->offset, cl, 2, ctx);
+                } else {
+                        pandecode_delta_print(ctx, '+', i, p);
+
+                        if (p->id == PANDECODE_PACKET_UNKNOWN)
+                                hexdump_sink(&ctx->out, cl, p->size, false);
+                        else
+                                agx_print_packed(&ctx->out, p->id, cl, 2, ctx);
+                }
+        }
+
+        agx_sink_putc(&ctx->out, '\n');
+
+        /* This frame becomes the baseline for the next */
+        ctx->current_frame = !ctx->current_frame;
+        ctx->frames[ctx->current_frame].count = 0;
+        ctx->frames[ctx->current_frame].data_size = 0;
+}
+
+/* One line per frame, cheap enough to leave on while tracing */
+
+static void
+pandecode_stats_emit(struct pandecode_context *ctx)
+{
+        const struct pandecode_stats *stats = &ctx->stats;
+
+        agx_sink_lit(&ctx->out, "frame ");
+        agx_sink_i64(&ctx->out, ctx->dump_frame_count);
+        agx_sink_lit(&ctx->out, ": draws ");
+        agx_sink_u64(&ctx->out, stats->draws);
+        agx_sink_lit(&ctx->out, ", launches ");
+        agx_sink_u64(&ctx->out, stats->launches);
+        agx_sink_lit(&ctx->out, ", records ");
+        agx_sink_u64(&ctx->out, stats->records);
+        agx_sink_lit(&ctx->out, ", pipeline binds ");
+        agx_sink_u64(&ctx->out, stats->pipeline_binds);
+        agx_sink_lit(&ctx->out, ", uniform binds ");
+        agx_sink_u64(&ctx->out, stats->uniform_binds);
+        agx_sink_lit(&ctx->out, ", shader bytes ");
+        agx_sink_u64(&ctx->out, stats->shader_bytes);
+
+        for (unsigned i = 0; i < AGX_NUM_ALLOC; ++i) {
+                agx_sink_lit(&ctx->out, ", ");
+                agx_sink_puts(&ctx->out, agx_alloc_types[i]);
+                agx_sink_lit(&ctx->out, " bytes ");
+                agx_sink_u64(&ctx->out, stats->bytes[i]);
+        }
+
+        agx_sink_putc(&ctx->out, '\n');
+
+        for (unsigned i = 0; i < ctx->encoder_count; ++i) {
+                const struct pandecode_encoder_stats *enc = &ctx->encoders[i];
+
+                agx_sink_lit(&ctx->out, "  encoder ");
+                agx_sink_u64(&ctx->out, i);
+                agx_sink_lit(&ctx->out, " @ ");
+                agx_sink_hex(&ctx->out, enc->va, 0, false);
+                agx_sink_lit(&ctx->out, ": draws ");
+                agx_sink_u64(&ctx->out, enc->draws);
+                agx_sink_lit(&ctx->out, ", launches ");
+                agx_sink_u64(&ctx->out, enc->launches);
+                agx_sink_lit(&ctx->out, ", records ");
+                agx_sink_u64(&ctx->out, enc->records);
+                agx_sink_lit(&ctx->out, ", bytes ");
+                agx_sink_u64(&ctx->out, enc->bytes);
+                agx_sink_lit(&ctx->out, ", shader bytes ");
+                agx_sink_u64(&ctx->out, enc->shader_bytes);
+                agx_sink_lit(&ctx->out, ", time ");
+                agx_sink_u64(&ctx->out, enc->ns / 1000);
+                agx_sink_lit(&ctx->out, " us\n");
+        }
+}
+
+static uint64_t
+pandecode_stats_bytes(const struct pandecode_stats *stats)
+{
+        uint64_t bytes = 0;
+
+        for (unsigned i = 0; i < AGX_NUM_ALLOC; ++i)
+                bytes += stats->bytes[i];
+
+        return bytes;
+}
+
+static uint64_t
+pandecode_now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Decodes one encoder's command stream, attributing its share of the frame
+ * statistics to it */
+
+static void
+pandecode_encoder(struct pandecode_context *ctx, uint64_t va, bool verbose)
+{
+        struct pandecode_stats before = ctx->stats;
+        uint64_t start = pandecode_now_ns();
+
+        memset(ctx->waste_bound, 0, sizeof(ctx->waste_bound));
+        pandecode_stateful(ctx, va, "Encoder", pandecode_cmd, verbose);
+
+        if (ctx->encoder_count == ctx->encoder_capacity) {
+                ctx->encoder_capacity = MAX2(ctx->encoder_capacity * 2, 8);
+                ctx->encoders = realloc(ctx->encoders, ctx->encoder_capacity * sizeof(*ctx->encoders));
+                assert(ctx->encoders != NULL);
+        }
+
+        ctx->encoders[ctx->encoder_count++] = (struct pandecode_encoder_stats) {
+                .va = va,
+                .draws = ctx->stats.draws - before.draws,
+                .launches = ctx->stats.launches - before.launches,
+                .records = ctx->stats.records - before.records,
+                .bytes = pandecode_stats_bytes(&ctx->stats) - pandecode_stats_bytes(&before),
+                .shader_bytes = ctx->stats.shader_bytes - before.shader_bytes,
+                .ns = pandecode_now_ns() - start,
+        };
+}
+
+/* The only thing known about a command buffer is that it points to the
+ * command stream of its encoder at CMDBUF_ENCODER. Buffers with several
+ * encoders are guessed to be a sequence of such headers, each starting with
+ * a nonzero word and giving its size in bytes in the second word, which is
+ * unconfirmed. So the first header is always decoded, later ones only while
+ * they look sane, and a note goes to stderr the first time one is found in
+ * case the guess is wrong. Returns the encoder of the header at *offset and
+ * steps past it, or 0 at the end. */
+
+#define CMDBUF_ENCODER 0x38
+
+static bool pandecode_encoder_guessed = false;
+
+static uint64_t
+pandecode_next_encoder(struct pandecode_context *ctx,
+                       const struct agx_allocation *cmdbuf, size_t *offset)
+{
+	const uint8_t *map = cmdbuf->map;
+	uint32_t header[2];
+	uint64_t encoder;
+
+	if (*offset + CMDBUF_ENCODER + 8 > cmdbuf->size)
+		return 0;
+
+	memcpy(header, map + *offset, sizeof(header));
+	memcpy(&encoder, map + *offset + CMDBUF_ENCODER, sizeof(encoder));
+
+	bool sized = header[1] >= CMDBUF_ENCODER + 8 &&
+		     header[1] <= cmdbuf->size - *offset;
+
+	if (*offset > 0) {
+		if (!header[0] || !sized || !encoder ||
+		    !pandecode_find_mapped_gpu_mem_containing_rw(ctx, encoder))
+			return 0;
+
+		if (!__atomic_exchange_n(&pandecode_encoder_guessed, true, __ATOMIC_RELAXED)) {
+			fprintf(stderr, "pandecode: guessing another encoder at offset 0x%zx "
+				"of command buffer %u, decoding may be wrong\n",
+				*offset, cmdbuf->index);
+		}
+	}
+
+	*offset = sized ? *offset + header[1] : cmdbuf->size;
+	return encoder;
+}
+
+/* Starts decoding a cmdstream, resetting the per-frame state */
+
+static struct agx_allocation *
+pandecode_cmdstream_begin(struct pandecode_context *ctx, unsigned cmdbuf_index)
+{
+        pandecode_ring_rotate(ctx);
+        pandecode_dump_file_open(ctx);
+        pandecode_ring_frame(ctx);
+
+	struct agx_allocation *cmdbuf = pandecode_find_cmdbuf(ctx, cmdbuf_index);
+	assert(cmdbuf != NULL && "nonexistant command buffer");
+
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->index.count = 0;
+	ctx->index.address_count = 0;
+	ctx->index_base = agx_sink_position(&ctx->out);
+	ctx->reach_count = 0;
+	ctx->cmdbuf = cmdbuf;
+	ctx->encoder_count = 0;
+	pandecode_set_clear(&ctx->shader_uses);
+	pandecode_set_clear(&ctx->waste_contents);
+	pandecode_set_clear(&ctx->waste_sites);
+	memset(ctx->waste, 0, sizeof(ctx->waste));
+
+	return cmdbuf;
+}
+
+void
+pandecode_cmdstream(struct pandecode_context *ctx, unsigned cmdbuf_index, bool verbose)
+{
+	struct agx_allocation *cmdbuf = pandecode_cmdstream_begin(ctx, cmdbuf_index);
+
+	if (verbose)
+		pandecode_dump_bo(ctx, cmdbuf, "Command buffer");
+
+	size_t offset = 0;
+	uint64_t encoder;
+
+	while ((encoder = pandecode_next_encoder(ctx, cmdbuf, &offset)))
+		pandecode_encoder(ctx, encoder, verbose);
+
+        if (ctx->format == PANDECODE_FORMAT_DELTA)
+                pandecode_delta_emit(ctx);
+        else if (ctx->format == PANDECODE_FORMAT_STATS)
+                pandecode_stats_emit(ctx);
+        else if (ctx->format == PANDECODE_FORMAT_WASTE)
+                pandecode_waste_emit(ctx);
+
+        agx_sink_flush(&ctx->out);
+        pandecode_map_read_write(ctx);
+}
+
+const struct pandecode_scanned_packet *
+pandecode_scan(struct pandecode_context *ctx, unsigned cmdbuf_index, unsigned *count)
+{
+	struct agx_allocation *cmdbuf = pandecode_cmdstream_begin(ctx, cmdbuf_index);
+	size_t offset = 0;
+	uint64_t encoder;
+
+	ctx->scan_count = 0;
+
+	for (unsigned i = 0; (encoder = pandecode_next_encoder(ctx, cmdbuf, &offset)); ++i)
+		pandecode_scan_encoder(ctx, encoder, i);
+
+	*count = ctx->scan_count;
+	return ctx->scan;
+}
+
+void
+pandecode_decode_packet(struct pandecode_context *ctx,
+                        const struct pandecode_scanned_packet *packet, bool verbose)
+{
+	const uint8_t *map = pandecode_fetch_gpu_mem(ctx, packet->va, 8);
+
+	ctx->encoder_count = packet->encoder;
 
-#include "decode.h"
-#include "io.h"
+	if (!pandecode_cmd(ctx, map, packet->va, verbose))
+		pandecode_unknown(ctx, map, 8, packet->va, false);
+}
 
-extern void agx_disassemble(void *_code, size_t maxlen, FILE *fp);
+void
+pandecode_scan_finish(struct pandecode_context *ctx)
+{
+        agx_sink_flush(&ctx->out);
+        pandecode_map_read_write(ctx);
+}
 
-FILE *pandecode_dump_stream;
+static void
+pandecode_dump_range(struct pandecode_context *ctx, const char *store,
+                     const struct agx_allocation *mem, size_t offset, size_t size)
+{
+        const uint8_t *data = (const uint8_t *) mem->map + offset;
 
-/* Memory handling, this can't pull in proper data structures so hardcode some
- * things, it should be "good enough" for most use cases */
+        assert(mem->type < AGX_NUM_ALLOC);
+        agx_sink_printf(&ctx->out, "Range: type %s, index %u, gpu %" PRIx64 ", size 0x%zx:",
+                        agx_alloc_types[mem->type], mem->index,
+                        mem->gpu_va + offset, size);
 
-#define MAX_MAPPINGS 4096
+        if (store) {
+                uint64_t hash = agx_hash(data, size, 0);
+                pandecode_store(ctx, &ctx->stored, store, data, size, hash);
+                agx_sink_printf(&ctx->out, " %016" PRIx64 ".bin\n", hash);
+        } else {
+                agx_sink_lit(&ctx->out, "\n\n");
+                hexdump_sink(&ctx->out, data, size, false);
+                agx_sink_putc(&ctx->out, '\n');
+        }
+}
 
-struct agx_allocation mmap_array[MAX_MAPPINGS];
-unsigned mmap_count = 0;
+static int
+pandecode_range_compare(const void *a, const void *b)
+{
+        const struct pandecode_range *ra = a, *rb = b;
+        return (ra->va > rb->va) - (ra->va < rb->va);
+}
 
-struct agx_allocation *ro_mappings[MAX_MAPPINGS];
-unsigned ro_mapping_count = 0;
+/* Dumps the command buffer and whatever GPU memory the last cmdstream decode
+ * found reachable from it, rather than every tracked mapping */
 
-static struct agx_allocation *
-pandecode_find_mapped_gpu_mem_containing_rw(uint64_t addr)
+void
+pandecode_dump_mappings(struct pandecode_context *ctx)
 {
-        for (unsigned i = 0; i < mmap_count; ++i) {
-                if (addr >= mmap_array[i].gpu_va && (addr - mmap_array[i].gpu_va) < mmap_array[i].size)
-                        return mmap_array + i;
+        /* Hexdumps have no structured equivalent */
+        if (!pandecode_is_text(ctx))
+                return;
+
+        pandecode_dump_file_open(ctx);
+
+        /* Content-addressed store, listing only hashes in the dump itself */
+        const char *store = getenv("PANDECODE_DUMP_STORE");
+
+        if (store && mkdir(store, 0755) != 0 && errno != EEXIST) {
+                fprintf(stderr, "pandecode: failed to create %s\n", store);
+                store = NULL;
         }
 
-        return NULL;
-}
+        if (ctx->cmdbuf && ctx->cmdbuf->map)
+                pandecode_dump_range(ctx, store, ctx->cmdbuf, 0, ctx->cmdbuf->size);
 
-struct agx_allocation *
-pandecode_find_mapped_gpu_mem_containing(uint64_t addr)
-{
-        struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing_rw(addr);
+        /* Merge overlapping ranges, then split them at BO boundaries */
+        qsort(ctx->reach, ctx->reach_count, sizeof(*ctx->reach), pandecode_range_compare);
 
-        if (mem && mem->map && !mem->ro) {
-                mprotect(mem->map, mem->size, PROT_READ);
-                mem->ro = true;
-                ro_mappings[ro_mapping_count++] = mem;
-                assert(ro_mapping_count < MAX_MAPPINGS);
+        for (unsigned i = 0; i < ctx->reach_count; ) {
+                uint64_t start = ctx->reach[i].va;
+                uint64_t end = start + ctx->reach[i].size;
+
+                for (++i; i < ctx->reach_count && ctx->reach[i].va <= end; ++i)
+                        end = MAX2(end, ctx->reach[i].va + ctx->reach[i].size);
+
+                while (start < end) {
+                        struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing_rw(ctx, start);
+
+                        /* Not CPU mapped, so there is nothing to dump */
+                        if (!mem || !mem->map)
+                                break;
+
+                        uint64_t stop = MIN2(end, mem->gpu_va + mem->size);
+                        pandecode_dump_range(ctx, store, mem, start - mem->gpu_va, stop - start);
+                        start = stop;
+                }
         }
 
-        return mem;
+	agx_sink_flush(&ctx->out);
 }
 
-static inline void *
-__pandecode_fetch_gpu_mem(const struct agx_allocation *mem,
-                          uint64_t gpu_va, size_t size,
-                          int line, const char *filename)
+static char *
+pandecode_intern(struct pandecode_context *ctx, const char *name)
 {
-        if (!mem)
-                mem = pandecode_find_mapped_gpu_mem_containing(gpu_va);
+        size_t len = strlen(name);
 
-        if (!mem) {
-                fprintf(stderr, "Access to unknown memory %" PRIx64 " in %s:%d\n",
-                        gpu_va, filename, line);
-		fflush(pandecode_dump_stream);
-                assert(0);
+        if ((ctx->name_count + 1) * 2 > ctx->name_capacity) {
+                char **old = ctx->name_table;
+                unsigned old_capacity = ctx->name_capacity;
+
+                ctx->name_capacity = MAX2(old_capacity * 2, 256);
+                ctx->name_table = calloc(ctx->name_capacity, sizeof(char *));
+                assert(ctx->name_table != NULL);
+
+                for (unsigned i = 0; i < old_capacity; ++i) {
+                        if (!old[i])
+                                continue;
+
+                        unsigned j = agx_hash(old[i], strlen(old[i]), 0);
+
+                        while (ctx->name_table[j & (ctx->name_capacity - 1)])
+                                ++j;
+
+                        ctx->name_table[j & (ctx->name_capacity - 1)] = old[i];
+                }
+
+                free(old);
         }
 
-        assert(mem);
-        assert(size + (gpu_va - mem->gpu_va) <= mem->size);
+        unsigned mask = ctx->name_capacity - 1;
+        unsigned i = agx_hash(name, len, 0) & mask;
 
-        return mem->map + gpu_va - mem->gpu_va;
+        for (; ctx->name_table[i]; i = (i + 1) & mask) {
+                if (!strcmp(ctx->name_table[i], name))
+                        return ctx->name_table[i];
+        }
+
+        assert(len < NAME_BLOCK_SIZE);
+
+        if (!ctx->names || ctx->names->used + len + 1 > NAME_BLOCK_SIZE) {
+                struct pandecode_name_block *block = malloc(sizeof(*block));
+                assert(block != NULL);
+
+                block->next = ctx->names;
+                block->used = 0;
+                ctx->names = block;
+        }
+
+        char *copy = ctx->names->data + ctx->names->used;
+        memcpy(copy, name, len + 1);
+        ctx->names->used += len + 1;
+
+        ctx->name_table[i] = copy;
+        ctx->name_count++;
+        return copy;
+}
+
+static void
+pandecode_forget_pages(struct pandecode_context *ctx, unsigned i)
+{
+        free(ctx->pages[i].hashes);
+        free(ctx->pages[i].dirty);
+        ctx->pages[i] = (struct pandecode_pages) { NULL };
 }
 
-#define pandecode_fetch_gpu_mem(gpu_va, size) \
-	__pandecode_fetch_gpu_mem(NULL, gpu_va, size, __LINE__, __FILE__)
+/* Interned names outlive the allocations they name, so in soak mode the
+ * blocks are rebuilt from the tracked allocations once there are too many.
+ * Cached pipelines hash name pointers, so are dropped too. */
 
 static void
-pandecode_map_read_write(void)
+pandecode_compact_names(struct pandecode_context *ctx)
 {
-        for (unsigned i = 0; i < ro_mapping_count; ++i) {
-                ro_mappings[i]->ro = false;
-                mprotect(ro_mappings[i]->map, ro_mappings[i]->size,
-                                PROT_READ | PROT_WRITE);
+        struct pandecode_name_block *old = ctx->names;
+
+        free(ctx->name_table);
+        ctx->names = NULL;
+        ctx->name_table = NULL;
+        ctx->name_count = ctx->name_capacity = 0;
+
+        for (unsigned i = 0; i < ctx->mmap_count; ++i)
+                ctx->mmap_array[i].name = pandecode_intern(ctx, ctx->mmap_array[i].name);
+
+        while (old) {
+                struct pandecode_name_block *next = old->next;
+                free(old);
+                old = next;
         }
 
-        ro_mapping_count = 0;
+        for (unsigned i = 0; i < PIPELINE_CACHE_SIZE; ++i)
+                ctx->pipeline_cache[i].va = 0;
 }
 
-/* Helpers for parsing the cmdstream */
+/* Tracing never sees allocations freed. In soak mode, a handle seen again
+ * replaces the allocation it named before, and the oldest allocation is
+ * forgotten rather than running out of slots. Tracking happens between
+ * submissions, so no mapping is read-only and nothing points into the
+ * array. */
 
-#define DUMP_UNPACKED(T, var, str) { \
-        pandecode_log(str); \
-        bl_print(pandecode_dump_stream, T, var, (pandecode_indent + 1) * 2); \
-}
+static unsigned
+pandecode_track_slot(struct pandecode_context *ctx, const struct agx_allocation *alloc)
+{
+        if (!ctx->ring_enabled)
+                return ctx->mmap_count++;
 
-#define DUMP_CL(T, cl, str) {\
-        bl_unpack(cl, T, temp); \
-        DUMP_UNPACKED(T, temp, str "\n"); \
-}
+        assert(ctx->ro_mapping_count == 0);
 
-#define pandecode_log(str) fputs(str, pandecode_dump_stream)
-#define pandecode_msg(str) fprintf(pandecode_dump_stream, "// %s", str)
+        if (ctx->name_count > RING_MAX_NAMES)
+                pandecode_compact_names(ctx);
 
-unsigned pandecode_indent = 0;
+        for (unsigned i = 0; i < ctx->mmap_count; ++i) {
+                if (ctx->mmap_array[i].type == alloc->type &&
+                    ctx->mmap_array[i].index == alloc->index) {
+                        pandecode_forget_pages(ctx, i);
+                        return i;
+                }
+        }
 
-/* To check for memory safety issues, validates that the given pointer in GPU
- * memory is valid, containing at least sz bytes. The goal is to detect
- * GPU-side memory bugs (NULL pointer dereferences, buffer overflows, or buffer
- * overruns) by statically validating pointers.
- */
+        if (ctx->mmap_count + 1 == MAX_MAPPINGS) {
+                pandecode_forget_pages(ctx, 0);
+                memmove(&ctx->mmap_array[0], &ctx->mmap_array[1],
+                        (ctx->mmap_count - 1) * sizeof(ctx->mmap_array[0]));
+                memmove(&ctx->pages[0], &ctx->pages[1],
+                        (ctx->mmap_count - 1) * sizeof(ctx->pages[0]));
+                ctx->pages[ctx->mmap_count - 1] = (struct pandecode_pages) { NULL };
+                ctx->mmap_count--;
+                ctx->cmdbuf = NULL;
+        }
 
-static void
-pandecode_validate_buffer(uint64_t addr, size_t sz)
+        return ctx->mmap_count++;
+}
+
+void
+pandecode_track_alloc(struct pandecode_context *ctx, struct agx_allocation alloc)
 {
-        if (!addr) {
-                pandecode_msg("XXX: null pointer deref");
-                return;
+        pandecode_ring_configure(ctx);
+        assert(alloc.type < AGX_NUM_ALLOC);
+
+        unsigned slot = pandecode_track_slot(ctx, &alloc);
+        assert(ctx->mmap_count < MAX_MAPPINGS);
+
+        /* Unnamed allocations are named after their type and index */
+        char name[32];
+
+        if (!alloc.name) {
+                snprintf(name, sizeof(name), "%s_%u", agx_alloc_types[alloc.type], alloc.index);
+                alloc.name = name;
         }
 
-        /* Find a BO */
+        alloc.name = pandecode_intern(ctx, alloc.name);
+        ctx->mmap_array[slot] = alloc;
+        ctx->by_va_valid = false;
+}
 
-        struct agx_allocation *bo =
-                pandecode_find_mapped_gpu_mem_containing(addr);
+/* Forget every tracked allocation, used when replaying a capture where each
+ * submission carries its own snapshot of the BOs */
 
-        if (!bo) {
-                pandecode_msg("XXX: invalid memory dereference\n");
-                return;
+void
+pandecode_untrack_all(struct pandecode_context *ctx)
+{
+        pandecode_map_read_write(ctx);
+
+        for (unsigned i = 0; i < ctx->mmap_count; ++i)
+                pandecode_forget_pages(ctx, i);
+
+        ctx->mmap_count = 0;
+        ctx->by_va_valid = false;
+        ctx->reach_count = 0;
+        ctx->cmdbuf = NULL;
+}
+
+/* Soak mode, for traces running for hours. Set PANDECODE_RING_FRAMES to keep
+ * the last N submissions or PANDECODE_RING_BYTES the last M bytes (with an
+ * optional K, M or G suffix) of dumps and captures on disk. Output goes to
+ * numbered segments, started once the current one reaches
+ * PANDECODE_RING_SEGMENT bytes (by default an eighth of the byte budget, or
+ * 64 MiB), deleting the oldest segments no longer needed. Sizes count bytes
+ * before compression. */
+
+static uint64_t
+pandecode_parse_size(const char *str)
+{
+        char *end;
+        uint64_t size = strtoull(str, &end, 0);
+
+        switch (*end) {
+        case 'G': case 'g':
+                size <<= 10;
+                /* fallthrough */
+        case 'M': case 'm':
+                size <<= 10;
+                /* fallthrough */
+        case 'K': case 'k':
+                size <<= 10;
+                break;
+        default:
+                break;
         }
 
-        /* Bounds check */
+        return size;
+}
 
-        unsigned offset = addr - bo->gpu_va;
-        unsigned total = offset + sz;
+/* Actions the app had for the signals soak mode marks crashes on, chained to
+ * after the marker */
+static const int pandecode_ring_signals[] = { SIGABRT, SIGSEGV, SIGBUS };
+static struct sigaction pandecode_ring_actions[ARRAY_SIZE(pandecode_ring_signals)];
 
-        if (total > bo->size) {
-                fprintf(pandecode_dump_stream, "// XXX: buffer overrun. "
-                                "Chunk of size %zu at offset %d in buffer of size %zu. "
-                                "Overrun by %zu bytes. \n",
-                                sz, offset, bo->size, total - bo->size);
+/* Runs in the crashing thread, possibly with stdio or the compressor's locks
+ * held, so only notes the crash with write(2). Nothing is flushed: segments
+ * already on disk stay there, as only the decoder deletes them, and output
+ * still buffered is lost. */
+
+static void
+pandecode_ring_signal(int sig, siginfo_t *info, void *uc)
+{
+        static const char marker[] =
+                "pandecode: crashed, ring segments on disk are left in place\n";
+
+        ssize_t ret = write(STDERR_FILENO, marker, sizeof(marker) - 1);
+        (void) ret;
+
+        for (unsigned i = 0; i < ARRAY_SIZE(pandecode_ring_signals); ++i) {
+                if (pandecode_ring_signals[i] != sig)
+                        continue;
+
+                const struct sigaction *old = &pandecode_ring_actions[i];
+                struct sigaction dfl = { .sa_handler = SIG_DFL };
+                sigemptyset(&dfl.sa_mask);
+
+                /* Ignoring a fault would run the faulting instruction again
+                 * forever, so die as if no handler were installed. The
+                 * signal is blocked until this handler returns. */
+                if (!(old->sa_flags & SA_SIGINFO) &&
+                    (old->sa_handler == SIG_DFL ||
+                     (old->sa_handler == SIG_IGN && sig != SIGABRT))) {
+                        sigaction(sig, &dfl, NULL);
+                        raise(sig);
+                        return;
+                }
+
+                if (!(old->sa_flags & SA_SIGINFO) && old->sa_handler == SIG_IGN)
+                        return;
+
+                /* Run the app's handler as it was installed */
+                if (old->sa_flags & SA_RESETHAND)
+                        sigaction(sig, &dfl, NULL);
+
+                sigset_t saved;
+                pthread_sigmask(SIG_BLOCK, &old->sa_mask, &saved);
+
+                if (old->sa_flags & SA_SIGINFO)
+                        old->sa_sigaction(sig, info, uc);
+                else
+                        old->sa_handler(sig);
+
+                pthread_sigmask(SIG_SETMASK, &saved, NULL);
                 return;
         }
 }
 
-static struct agx_allocation *
-pandecode_find_cmdbuf(unsigned cmdbuf_index)
+static void
+pandecode_ring_configure(struct pandecode_context *ctx)
 {
-	for (unsigned i = 0; i < mmap_count; ++i) {
-		if (mmap_array[i].type != AGX_ALLOC_CMDBUF)
-			continue;
+        if (ctx->ring_checked)
+                return;
 
-		if (mmap_array[i].index != cmdbuf_index)
-			continue;
+        ctx->ring_checked = true;
 
-		return &mmap_array[i];
-	}
+        const char *frames = getenv("PANDECODE_RING_FRAMES");
+        const char *bytes = getenv("PANDECODE_RING_BYTES");
+        const char *segment = getenv("PANDECODE_RING_SEGMENT");
 
-	return NULL;
+        ctx->ring_frames = frames ? strtoul(frames, NULL, 0) : 0;
+        ctx->ring_bytes = bytes ? pandecode_parse_size(bytes) : 0;
+        ctx->ring_enabled = ctx->ring_frames || ctx->ring_bytes;
+
+        if (!ctx->ring_enabled)
+                return;
+
+        if (segment)
+                ctx->ring_segment = MAX2(pandecode_parse_size(segment), 1);
+        else if (ctx->ring_bytes)
+                ctx->ring_segment = MAX2(ctx->ring_bytes / 8, 1 << 20);
+        else
+                ctx->ring_segment = 64 << 20;
+
+        const char *keep = getenv("PANDECODE_RING_KEEP");
+        ctx->ring_keep = keep ? strtoul(keep, NULL, 0) : 4;
+
+        struct sigaction action = {
+                .sa_sigaction = pandecode_ring_signal,
+                .sa_flags = SA_SIGINFO,
+        };
+
+        sigemptyset(&action.sa_mask);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(pandecode_ring_signals); ++i)
+                sigaction(pandecode_ring_signals[i], &action, &pandecode_ring_actions[i]);
 }
 
 static void
-pandecode_dump_bo(struct agx_allocation *bo, const char *name)
+pandecode_ring_add(struct pandecode_ring *ring, const char *path)
 {
-	fprintf(pandecode_dump_stream, "%s %s (%u)\n", name, bo->name ?: "", bo->index);
-	hexdump(pandecode_dump_stream, bo->map, bo->size, false);
+        if (ring->count == ring->capacity) {
+                ring->capacity = MAX2(ring->capacity * 2, 16);
+                ring->segments = realloc(ring->segments, ring->capacity * sizeof(*ring->segments));
+                assert(ring->segments != NULL);
+        }
+
+        ring->segments[ring->count++] = (struct pandecode_ring_segment) {
+                .path = strdup(path),
+        };
+
+        ring->next++;
 }
 
-/* Abstraction for command stream parsing */
-typedef unsigned (*decode_cmd)(const uint8_t *map, bool verbose);
+static struct pandecode_ring_segment *
+pandecode_ring_current(struct pandecode_ring *ring)
+{
+        assert(ring->count > 0);
+        return &ring->segments[ring->count - 1];
+}
 
-#define STATE_DONE (0xFFFFFFFFu)
+/* Deletes the oldest segments while the rest still cover the frame budget,
+ * or while over the byte budget, always keeping the newest */
 
 static void
-pandecode_stateful(uint64_t va, const char *label, decode_cmd decoder, bool verbose)
+pandecode_ring_trim(struct pandecode_context *ctx, struct pandecode_ring *ring)
 {
-	struct agx_allocation *alloc = pandecode_find_mapped_gpu_mem_containing(va);
-	assert(alloc != NULL && "nonexistant object");
-	fprintf(pandecode_dump_stream, "%s\n", label);
-
-	uint8_t *map = pandecode_fetch_gpu_mem(va, 64);
-	uint8_t *end = map + alloc->size;
+        uint64_t bytes = 0;
+        unsigned frames = 0;
 
-	if (verbose)
-		pandecode_dump_bo(alloc, label);
+        for (unsigned i = 0; i < ring->count; ++i) {
+                bytes += ring->segments[i].bytes;
+                frames += ring->segments[i].frames;
+        }
 
-	 while (map < end) {
-		 unsigned count = decoder(map, verbose);
+        while (ring->count > 1) {
+                struct pandecode_ring_segment *oldest = &ring->segments[0];
+                bool over = ctx->ring_bytes && bytes > ctx->ring_bytes;
+                bool spare = ctx->ring_frames && frames - oldest->frames >= ctx->ring_frames;
 
-		 /* If we fail to decode, default to a hexdump (don't hang) */
-		 if (count == 0) {
-			hexdump(pandecode_dump_stream, map, 8, false);
-			count = 8;
-		 }
+                if (!over && !spare)
+                        break;
 
-		 map += count;
+                if (unlink(oldest->path))
+                        fprintf(stderr, "pandecode: failed to delete %s\n", oldest->path);
 
-		 if (count == STATE_DONE)
-			 break;
-	 }
+                bytes -= oldest->bytes;
+                frames -= oldest->frames;
+                free(oldest->path);
+                memmove(oldest, oldest + 1, (ring->count - 1) * sizeof(*oldest));
+                ring->count--;
+        }
 }
 
-static unsigned
-pandecode_pipeline(const uint8_t *map, UNUSED bool verbose)
+/* Moves every segment of the ring to the kept segments, as part of
+ * snapshot number ctx->ring_snapshots. Only the last ring_keep snapshots
+ * are kept, so repeated triggers do not grow disk use without bound. */
+
+static void
+pandecode_ring_keep(struct pandecode_context *ctx, struct pandecode_ring *ring)
 {
-	uint8_t zeroes[16] = { 0 };
+        struct pandecode_ring *kept = &ctx->kept_ring;
 
-	if (map[0] == 0x4D && map[1] == 0xbd) {
-		/* TODO: Disambiguation for extended is a guess */
-		bl_unpack(map, SET_SHADER_EXTENDED, cmd);
-		DUMP_UNPACKED(SET_SHADER_EXTENDED, cmd, "Set shader\n");
+        for (unsigned i = 0; i < ring->count; ++i) {
+                fprintf(stderr, "pandecode: kept %s\n", ring->segments[i].path);
+                pandecode_ring_add(kept, ring->segments[i].path);
+                pandecode_ring_current(kept)->snapshot = ctx->ring_snapshots;
+                free(ring->segments[i].path);
+        }
 
-		if (cmd.preshader_mode == AGX_PRESHADER_MODE_PRESHADER) {
-			pandecode_log("Preshader\n");
-			agx_disassemble(pandecode_fetch_gpu_mem(cmd.preshader_code, 8192),
-				8192, pandecode_dump_stream);
-			pandecode_log("\n---\n");
-		}
+        ring->count = 0;
 
-		pandecode_log("\n");
-		agx_disassemble(pandecode_fetch_gpu_mem(cmd.code, 8192),
-			8192, pandecode_dump_stream);
-		pandecode_log("\n");
+        unsigned first = ctx->ring_snapshots >= ctx->ring_keep ?
+                         ctx->ring_snapshots - ctx->ring_keep + 1 : 0;
 
-		return AGX_SET_SHADER_EXTENDED_LENGTH;
-	} else if (map[0] == 0x4D) {
-		bl_unpack(map, SET_SHADER, cmd);
-		DUMP_UNPACKED(SET_SHADER, cmd, "Set shader\n");
+        while (kept->count && kept->segments[0].snapshot < first) {
+                struct pandecode_ring_segment *oldest = &kept->segments[0];
 
-		if (cmd.preshader_mode == AGX_PRESHADER_MODE_PRESHADER) {
-			pandecode_log("Preshader\n");
-			agx_disassemble(pandecode_fetch_gpu_mem(cmd.preshader_code, 8192),
-				8192, pandecode_dump_stream);
-			pandecode_log("\n---\n");
-		}
+                if (unlink(oldest->path))
+                        fprintf(stderr, "pandecode: failed to delete %s\n", oldest->path);
 
-		pandecode_log("\n");
-		agx_disassemble(pandecode_fetch_gpu_mem(cmd.code, 8192),
-			8192, pandecode_dump_stream);
-		FILE *fp = fopen("vertex.bin", "wb");
-		fwrite(pandecode_fetch_gpu_mem(cmd.code, 8192), 1, 8192, fp);
-		fclose(fp);
-		pandecode_log("\n");
-
-		return AGX_SET_SHADER_LENGTH;
-	} else if (map[0] == 0x1D) {
-		DUMP_CL(BIND_UNIFORM, map, "Bind uniform");
-		return AGX_BIND_UNIFORM_LENGTH;
-	} else if (memcmp(map, zeroes, 16) == 0) {
-		/* TODO: Termination */
-		return STATE_DONE;
-	} else {
-		return 0;
-	}
+                free(oldest->path);
+                memmove(oldest, oldest + 1, (kept->count - 1) * sizeof(*oldest));
+                kept->count--;
+        }
 }
 
 static void
-pandecode_record(uint64_t va, size_t size, bool verbose)
+pandecode_ring_fini(struct pandecode_ring *ring)
 {
-	uint8_t *map = pandecode_fetch_gpu_mem(va, size);
-	uint32_t tag = 0;
-	memcpy(&tag, map, 4);
-
-	if (tag == 0x00000C00) {
-		assert(size == AGX_VIEWPORT_LENGTH);
-		DUMP_CL(VIEWPORT, map, "Viewport");
-	} else if (tag == 0x0C020000) {
-		assert(size == AGX_LINKAGE_LENGTH);
-		DUMP_CL(LINKAGE, map, "Linkage");
-	} else if (tag == 0x800000) {
-		assert(size == (AGX_BIND_PIPELINE_LENGTH + 4));
-//		XXX: why does this raise a bus error?
-//		uint32_t unk = 0;
-//		memcpy(map + AGX_BIND_PIPELINE_LENGTH, &unk, 4);
+        for (unsigned i = 0; i < ring->count; ++i)
+                free(ring->segments[i].path);
 
-		 bl_unpack(map, BIND_PIPELINE, cmd);
-		 pandecode_stateful(cmd.pipeline, "Pipeline", pandecode_pipeline, verbose);
-		 DUMP_UNPACKED(BIND_PIPELINE, cmd, "Bind fragment pipeline\n");
-//		 fprintf(pandecode_dump_stream, "Unk: %X\n", unk);
-	} else {
-		fprintf(pandecode_dump_stream, "Record %" PRIx64 "\n", va);
-		hexdump(pandecode_dump_stream, map, size, false);
-	}
+        free(ring->segments);
+        *ring = (struct pandecode_ring) { NULL };
 }
 
-static unsigned
-pandecode_cmd(const uint8_t *map, bool verbose)
+/* Closes the dump segment before a submission if it is full, so the next
+ * dump_file_open starts another */
+
+static void
+pandecode_ring_rotate(struct pandecode_context *ctx)
 {
-	if (map[0] == 0x02 && map[1] == 0x10 && map[2] == 0x00 && map[3] == 0x00) {
-		 bl_unpack(map, LAUNCH, cmd);
-		 pandecode_stateful(cmd.pipeline, "Pipeline", pandecode_pipeline, verbose);
-		 DUMP_UNPACKED(LAUNCH, cmd, "Launch\n");
-		 return AGX_LAUNCH_LENGTH;
-	} else if (map[0] == 0x2E && map[1] == 0x00 && map[2] == 0x00 && map[3] == 0x40) {
-		 bl_unpack(map, BIND_PIPELINE, cmd);
-		 pandecode_stateful(cmd.pipeline, "Pipeline", pandecode_pipeline, verbose);
-		 DUMP_UNPACKED(BIND_PIPELINE, cmd, "Bind vertex pipeline\n");
+        if (!ctx->ring_enabled || !ctx->dump_stream || ctx->external_stream ||
+            ctx->dump_stream == stderr)
+                return;
 
-		 /* Random unaligned null byte, it's pretty awful.. */
-		 assert(map[AGX_BIND_PIPELINE_LENGTH] == 0);
-		 return AGX_BIND_PIPELINE_LENGTH + 1;
-	} else if (map[1] == 0xc0 && map[2] == 0x61) {
-		 DUMP_CL(DRAW, map, "Draw");
-		 return AGX_DRAW_LENGTH;
-	} else if (map[0] == 0x00 && map[1] == 0x00 && map[2] == 0x00 && map[3] == 0xc0) {
-		return STATE_DONE;
-	} else if (map[1] == 0x00 && map[2] == 0x00) {
-		/* No need to explicitly dump the record */
-		 bl_unpack(map, RECORD, cmd);
-		 struct agx_allocation *mem = pandecode_find_mapped_gpu_mem_containing(cmd.data);
+        struct pandecode_ring_segment *segment = pandecode_ring_current(&ctx->dump_ring);
+        segment->bytes = agx_sink_position(&ctx->out) - ctx->dump_mark;
 
-		 if (mem)
-			 pandecode_record(cmd.data, cmd.size_words * 4, verbose);
-		 else
-			 DUMP_UNPACKED(RECORD, cmd, "Non-existant record (XXX)\n");
+        if (segment->bytes < ctx->ring_segment)
+                return;
 
-		 return AGX_RECORD_LENGTH;
-	} else if (map[0] == 0 && map[1] == 0 && map[2] == 0xC0 && map[3] == 0x00) {
-		unsigned zero[16] = { 0 };
-		assert(memcmp(map + 4, zero, sizeof(zero)) == 0);
-		return STATE_DONE;
-	} else {
-		return 0;
-	}
+        pandecode_dump_file_close(ctx);
+        pandecode_ring_trim(ctx, &ctx->dump_ring);
 }
 
-void
-pandecode_cmdstream(unsigned cmdbuf_index, bool verbose)
-{
-        pandecode_dump_file_open();
+/* Counts a submission against the dump segment, and cuts back hash sets
+ * that only grow. Forgetting a stored hash just means storing the file
+ * again. */
 
-	struct agx_allocation *cmdbuf = pandecode_find_cmdbuf(cmdbuf_index);
-	assert(cmdbuf != NULL && "nonexistant command buffer");
+static void
+pandecode_ring_frame(struct pandecode_context *ctx)
+{
+        if (!ctx->ring_enabled)
+                return;
 
-	if (verbose)
-		pandecode_dump_bo(cmdbuf, "Command buffer");
+        if (ctx->dump_ring.count && ctx->out.fp && !ctx->external_stream)
+                pandecode_ring_current(&ctx->dump_ring)->frames++;
 
-	/* TODO: What else is in here? */
-	uint64_t *encoder = ((uint64_t *) cmdbuf->map) + 7;
-	pandecode_stateful(*encoder, "Encoder", pandecode_cmd, verbose);
+        if (ctx->stored.count > RING_MAX_HASHES)
+                pandecode_set_clear(&ctx->stored);
 
-        pandecode_map_read_write();
+        if (ctx->shaders_stored.count > RING_MAX_HASHES)
+                pandecode_set_clear(&ctx->shaders_stored);
 }
 
+/* Flushes everything traced so far, for when a GPU fault or assertion is
+ * about to be investigated. In soak mode the segments being written are
+ * closed, so compressed ones are complete on disk, and the segments so far
+ * are kept as a snapshot while the ring starts over with new ones. Must not
+ * be called from a signal handler. */
+
 void
-pandecode_dump_mappings(void)
+pandecode_ring_trigger(struct pandecode_context *ctx, const char *reason)
 {
-        pandecode_dump_file_open();
+        fprintf(stderr, "pandecode: %s, flushing trace\n", reason);
 
-	for (unsigned i = 0; i < mmap_count; ++i) {
-		if (!mmap_array[i].map || !mmap_array[i].size)
-			continue;
+        if (ctx->dump_stream) {
+                if (pandecode_is_text(ctx))
+                        agx_sink_printf(&ctx->out, "pandecode: %s\n", reason);
+
+                agx_sink_flush(&ctx->out);
+                fflush(ctx->dump_stream);
+        }
+
+        if (ctx->capture_stream)
+                fflush(ctx->capture_stream);
 
-		assert(mmap_array[i].type < AGX_NUM_ALLOC);
+        if (!ctx->ring_enabled)
+                return;
 
-		fprintf(pandecode_dump_stream, "Buffer: type %s, gpu %llx, index %u.bin:\n\n",
-			agx_alloc_types[mmap_array[i].type],
-			mmap_array[i].gpu_va, mmap_array[i].index);
+        pandecode_dump_file_close(ctx);
 
-		hexdump(pandecode_dump_stream, mmap_array[i].map, mmap_array[i].size, false);
-		fprintf(pandecode_dump_stream, "\n");
-	}
+        if (ctx->capture_stream) {
+                fclose(ctx->capture_stream);
+                ctx->capture_stream = NULL;
+        }
+
+        pandecode_ring_keep(ctx, &ctx->dump_ring);
+        pandecode_ring_keep(ctx, &ctx->capture_ring);
+        ctx->ring_snapshots++;
 }
 
+/* Writes a capture record, counting it against the capture segment */
+
+static void
+pandecode_capture_write(struct pandecode_context *ctx,
+                        const struct agx_capture_record *rec, const void *data)
+{
+        agx_capture_write(ctx->capture_stream, rec, data);
+
+        if (ctx->ring_enabled) {
+                pandecode_ring_current(&ctx->capture_ring)->bytes +=
+                        ALIGN_POT(sizeof(*rec) + rec->size, AGX_CAPTURE_ALIGN);
+        }
+}
 
+/* Records a BO in full the first time, and after that only if the CPU wrote
+ * to it: in full if most pages changed, otherwise the changed pages */
 
 static void
-pandecode_add_name(struct agx_allocation *mem, uint64_t gpu_va, const char *name)
+pandecode_capture_bo(struct pandecode_context *ctx, unsigned i)
 {
-        if (!name) {
-                /* If we don't have a name, assign one */
+        struct agx_allocation *bo = &ctx->mmap_array[i];
+        struct pandecode_pages *pages = &ctx->pages[i];
+        unsigned count = DIV_ROUND_UP(bo->size, AGX_CAPTURE_PAGE_SIZE);
+        unsigned dirty = 0;
+        bool first = (pages->hashes == NULL);
+
+        if (first) {
+                pages->hashes = calloc(count, sizeof(*pages->hashes));
+                pages->dirty = calloc(count, sizeof(*pages->dirty));
+                assert(pages->hashes != NULL && pages->dirty != NULL);
+        }
 
-                snprintf(mem->name, sizeof(mem->name) - 1,
-                         "memory_%" PRIx64, gpu_va);
-        } else {
-                assert((strlen(name) + 1) < sizeof(mem->name));
-                memcpy(mem->name, name, strlen(name) + 1);
+        for (unsigned p = 0; p < count; ++p) {
+                size_t offset = (size_t) p * AGX_CAPTURE_PAGE_SIZE;
+                uint64_t hash = agx_hash((uint8_t *) bo->map + offset,
+                                         MIN2(AGX_CAPTURE_PAGE_SIZE, bo->size - offset), 0);
+
+                pages->dirty[p] = first || (hash != pages->hashes[p]);
+                pages->hashes[p] = hash;
+                dirty += pages->dirty[p];
+        }
+
+        struct agx_capture_record rec = {
+                .type = AGX_CAPTURE_BO,
+                .index = bo->index,
+                .alloc_type = bo->type,
+                .gpu_va = bo->gpu_va,
+                .size = bo->size,
+        };
+
+        if (dirty * 2 > count) {
+                pandecode_capture_write(ctx, &rec, bo->map);
+                return;
+        }
+
+        rec.type = AGX_CAPTURE_PAGE;
+
+        for (unsigned p = 0; p < count; ++p) {
+                if (!pages->dirty[p])
+                        continue;
+
+                size_t offset = (size_t) p * AGX_CAPTURE_PAGE_SIZE;
+                rec.page = p;
+                rec.size = MIN2(AGX_CAPTURE_PAGE_SIZE, bo->size - offset);
+                pandecode_capture_write(ctx, &rec, (uint8_t *) bo->map + offset);
         }
 }
 
-void
-pandecode_track_alloc(struct agx_allocation alloc)
+/* With PANDECODE_COMPRESS set, dumps and captures are written as compressed
+ * streams (see lz.h), compressed on a background thread */
+
+static FILE *
+pandecode_fopen(const char *path)
 {
-        assert((mmap_count + 1) < MAX_MAPPINGS);
-        mmap_array[mmap_count++] = alloc;
+        FILE *fp = fopen(path, "wb");
+
+        if (getenv("PANDECODE_COMPRESS"))
+                fp = agx_lz_fopen(fp);
+
+        return fp;
 }
 
-static char *
-pointer_as_memory_reference(uint64_t ptr)
+/* Snapshot every CPU-mapped allocation along with the submitted command
+ * buffer, so the submission can be decoded later with decode-bin. Only what
+ * changed since the previous submission is written. */
+
+void
+pandecode_capture_submit(struct pandecode_context *ctx, unsigned cmdbuf_index)
 {
-        struct agx_allocation *mapped;
-        char *out = malloc(128);
+        pandecode_ring_configure(ctx);
+
+        if (ctx->capture_stream && ctx->ring_enabled &&
+            pandecode_ring_current(&ctx->capture_ring)->bytes >= ctx->ring_segment) {
+                fclose(ctx->capture_stream);
+                ctx->capture_stream = NULL;
+                pandecode_ring_trim(ctx, &ctx->capture_ring);
+        }
 
-        /* Try to find the corresponding mapped zone */
+        if (!ctx->capture_stream) {
+                const char *base = getenv("PANDECODE_CAPTURE_FILE") ?: "pandecode.capture";
+                char path[1024];
 
-        mapped = pandecode_find_mapped_gpu_mem_containing_rw(ptr);
+                if (ctx->ring_enabled)
+                        snprintf(path, sizeof(path), "%s.ring%04u", base, ctx->capture_ring.next);
+                else
+                        snprintf(path, sizeof(path), "%s", base);
 
-        if (mapped) {
-                snprintf(out, 128, "%s + %d", mapped->name, (int) (ptr - mapped->gpu_va));
-                return out;
+                ctx->capture_stream = pandecode_fopen(path);
+
+                if (!ctx->capture_stream) {
+                        fprintf(stderr, "pandecode: failed to open capture file %s\n", path);
+                        return;
+                }
+
+                printf("pandecode: capture submissions to file %s\n", path);
+                agx_capture_write_header(ctx->capture_stream);
+
+                if (ctx->ring_enabled)
+                        pandecode_ring_add(&ctx->capture_ring, path);
+
+                /* Each file must decode alone, so starts with every BO in full */
+                for (unsigned i = 0; i < ctx->mmap_count; ++i)
+                        pandecode_forget_pages(ctx, i);
         }
 
-        /* Just use the raw address if other options are exhausted */
+	for (unsigned i = 0; i < ctx->mmap_count; ++i) {
+		if (ctx->mmap_array[i].map && ctx->mmap_array[i].size)
+			pandecode_capture_bo(ctx, i);
+	}
+
+	struct agx_capture_record submit = {
+		.type = AGX_CAPTURE_SUBMIT,
+		.index = cmdbuf_index,
+	};
 
-        snprintf(out, 128, "0x%" PRIx64, ptr);
-        return out;
+	pandecode_capture_write(ctx, &submit, NULL);
 
+	if (ctx->ring_enabled)
+		pandecode_ring_current(&ctx->capture_ring)->frames++;
+
+	/* Keep the capture usable if the traced app crashes. Compressed
+	 * captures only get whole blocks out, see lz.h. */
+	fflush(ctx->capture_stream);
 }
 
-static int pandecode_dump_frame_count = 0;
 
 void
-pandecode_dump_file_open(void)
+pandecode_dump_file_open(struct pandecode_context *ctx)
 {
-        if (pandecode_dump_stream)
+        if (ctx->dump_stream)
                 return;
 
+        pandecode_ring_configure(ctx);
+
         /* This does a getenv every frame, so it is possible to use
          * setenv to change the base at runtime.
          */
         const char *dump_file_base = getenv("PANDECODE_DUMP_FILE") ?: "pandecode.dump";
+        const char *suffix = getenv("PANDECODE_COMPRESS") ? ".z" : "";
+
         if (!strcmp(dump_file_base, "stderr"))
-                pandecode_dump_stream = stderr;
+                ctx->dump_stream = stderr;
         else {
                 char buffer[1024];
-                snprintf(buffer, sizeof(buffer), "%s.%04d", dump_file_base, pandecode_dump_frame_count);
+
+                if (ctx->ring_enabled)
+                        snprintf(buffer, sizeof(buffer), "%s.ring%04u%s", dump_file_base,
+                                 ctx->dump_ring.next, suffix);
+                else
+                        snprintf(buffer, sizeof(buffer), "%s.%04d%s", dump_file_base,
+                                 ctx->dump_frame_count, suffix);
+
                 printf("pandecode: dump command stream to file %s\n", buffer);
-                pandecode_dump_stream = fopen(buffer, "w");
-                if (!pandecode_dump_stream)
+                ctx->dump_stream = pandecode_fopen(buffer);
+                if (!ctx->dump_stream)
                         fprintf(stderr,
                                 "pandecode: failed to open command stream log file %s\n",
                                 buffer);
+                else if (ctx->ring_enabled) {
+                        pandecode_ring_add(&ctx->dump_ring, buffer);
+                        ctx->dump_mark = agx_sink_position(&ctx->out);
+                }
         }
+
+        ctx->out.fp = ctx->dump_stream;
 }
 
 static void
-pandecode_dump_file_close(void)
+pandecode_dump_file_close(struct pandecode_context *ctx)
 {
-        if (pandecode_dump_stream && pandecode_dump_stream != stderr) {
-                fclose(pandecode_dump_stream);
-                pandecode_dump_stream = NULL;
+        agx_sink_flush(&ctx->out);
+
+        if (ctx->external_stream)
+                return;
+
+        if (ctx->dump_stream && ctx->dump_stream != stderr) {
+                fclose(ctx->dump_stream);
+                ctx->dump_stream = NULL;
+                ctx->out.fp = NULL;
         }
 }
 
+/* For offline decoding, where frames are numbered by submission and may be
+ * decoded out of order */
+
+void
+pandecode_set_frame(struct pandecode_context *ctx, int frame)
+{
+        ctx->dump_frame_count = frame;
+}
+
 void
-pandecode_next_frame(void)
+pandecode_next_frame(struct pandecode_context *ctx)
 {
-        pandecode_dump_file_close();
-        pandecode_dump_frame_count++;
+        pandecode_dump_file_close(ctx);
+        ctx->dump_frame_count++;
 }
 
 void
-pandecode_close(void)
+pandecode_close(struct pandecode_context *ctx)
 {
-        pandecode_dump_file_close();
+        pandecode_dump_file_close(ctx);
+
+        if (ctx->capture_stream) {
+                fclose(ctx->capture_stream);
+                ctx->capture_stream = NULL;
+        }
+        if (ctx->shader_index) {
+                fclose(ctx->shader_index);
+                ctx->shader_index = NULL;
+        }
+
+        ctx->shader_store_checked = false;
 }
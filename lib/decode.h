@@ -26,18 +26,145 @@
 #ifndef __PAN_DECODE_H__
 #define __PAN_DECODE_H__
 
-#include "io.h"
+#include <stdio.h>
+#include "alloc.h"
 
-void pandecode_next_frame(void);
+struct pandecode_context;
 
-void pandecode_close(void);
+enum pandecode_format {
+        /* Indented human-readable text */
+        PANDECODE_FORMAT_TEXT = 0,
 
-void pandecode_cmdstream(unsigned cmdbuf_index, bool verbose);
+        /* One JSON object per line per packet */
+        PANDECODE_FORMAT_JSON,
 
-void pandecode_dump_file_open(void);
+        /* One pandecode_packet_record per packet */
+        PANDECODE_FORMAT_BINARY,
 
-void pandecode_track_alloc(struct agx_allocation alloc);
+        /* Text of only the packets that changed since the previous
+         * cmdstream decoded with the context */
+        PANDECODE_FORMAT_DELTA,
 
-void pandecode_dump_mappings(void);
+        /* One summary line of packet counts and bytes walked per cmdstream,
+         * without printing any packets */
+        PANDECODE_FORMAT_STATS,
+
+        /* One line per cmdstream of the packets and bytes spent re-uploading
+         * identical data or re-binding unchanged state */
+        PANDECODE_FORMAT_WASTE,
+};
+
+/* Binary records are followed by the size bytes of the packet as it was in
+ * GPU memory, which can be unpacked with the matching AGX_*_unpack given the
+ * AGX_*_ID in type. */
+
+#define PANDECODE_PACKET_UNKNOWN (0xFFFF)
+
+struct pandecode_packet_record {
+        uint32_t type;
+        uint32_t size;
+        uint32_t frame;
+        uint32_t padding;
+        uint64_t va;
+} __attribute__((packed));
+
+struct pandecode_context *pandecode_create_context(void);
+
+void pandecode_destroy_context(struct pandecode_context *ctx);
+
+void pandecode_set_format(struct pandecode_context *ctx, enum pandecode_format format);
+
+/* Decoded pipelines are cached and replayed when referenced again unchanged.
+ * With backrefs, a one-line reference to the first decode is printed
+ * instead. */
+
+void pandecode_set_backrefs(struct pandecode_context *ctx, bool backrefs);
+
+/* With indexing, the position in the output of every packet decoded is
+ * recorded, for decode-bin -i. Offsets count from the start of the output of
+ * the last cmdstream decoded, and type is a static string. */
+
+struct pandecode_indexed_packet {
+        uint64_t va;
+        const char *type;
+        uint32_t id;
+        uint32_t offset;
+        uint32_t encoder;
+};
+
+/* Along with the value of every address field in those packets, with the
+ * index of the packet holding it. Field names are static strings. The size
+ * referenced is given where the decoder knows it, and is zero otherwise. */
+
+struct pandecode_indexed_address {
+        uint64_t va;
+        uint64_t size;
+        const char *field;
+        uint32_t packet;
+};
+
+void pandecode_set_index(struct pandecode_context *ctx, bool index);
+
+const struct pandecode_indexed_packet *
+pandecode_indexed_packets(struct pandecode_context *ctx, unsigned *count);
+
+const struct pandecode_indexed_address *
+pandecode_indexed_addresses(struct pandecode_context *ctx, unsigned *count);
+
+/* Bytes of output written so far, across dump streams */
+
+uint64_t pandecode_output_position(struct pandecode_context *ctx);
+
+void pandecode_set_dump_stream(struct pandecode_context *ctx, FILE *fp);
+
+void pandecode_next_frame(struct pandecode_context *ctx);
+
+void pandecode_set_frame(struct pandecode_context *ctx, int frame);
+
+void pandecode_close(struct pandecode_context *ctx);
+
+void pandecode_cmdstream(struct pandecode_context *ctx, unsigned cmdbuf_index, bool verbose);
+
+/* Two-phase decoding. pandecode_scan finds the packets in the encoders of a
+ * command buffer from their headers alone, without unpacking or printing
+ * anything, and any of them can then be decoded and printed on its own with
+ * pandecode_decode_packet, as pandecode_cmdstream would have. Packets held in
+ * records have the type of their contents and the address of the record
+ * command. The table is valid until the next scan, and pandecode_scan_finish
+ * ends the frame. */
+
+struct pandecode_scanned_packet {
+        uint64_t va;
+        const char *type;
+        uint32_t id;
+        uint16_t encoder;
+        bool record;
+};
+
+const struct pandecode_scanned_packet *
+pandecode_scan(struct pandecode_context *ctx, unsigned cmdbuf_index, unsigned *count);
+
+void pandecode_decode_packet(struct pandecode_context *ctx,
+                             const struct pandecode_scanned_packet *packet, bool verbose);
+
+void pandecode_scan_finish(struct pandecode_context *ctx);
+
+void pandecode_dump_file_open(struct pandecode_context *ctx);
+
+void pandecode_track_alloc(struct pandecode_context *ctx, struct agx_allocation alloc);
+
+void pandecode_untrack_all(struct pandecode_context *ctx);
+
+/* Dumps the memory reachable from the last cmdstream decoded */
+
+void pandecode_dump_mappings(struct pandecode_context *ctx);
+
+void pandecode_capture_submit(struct pandecode_context *ctx, unsigned cmdbuf_index);
+
+/* Flushes the dump and capture, for a GPU fault or anything else worth
+ * keeping the trace leading up to. See pandecode_ring_configure for soak
+ * mode, where this also keeps the segments so far from being deleted. */
+
+void pandecode_ring_trigger(struct pandecode_context *ctx, const char *reason);
 
 #endif /* __MMAP_TRACE_H__ */
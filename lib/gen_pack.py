@@ -25,7 +25,10 @@
 
 import xml.parsers.expat
 import sys
+import io
+import contextlib
 import operator
+import struct
 from functools import reduce
 
 global_prefix = "agx"
@@ -47,7 +50,9 @@ pack_header = """
 #include <assert.h>
 #include <math.h>
 #include <inttypes.h>
+#include <string.h>
 #include "lib/util.h"
+#include "lib/sink.h"
 
 #define __gen_unpack_float(x, y, z) uif(__gen_unpack_uint(x, y, z))
 
@@ -85,7 +90,7 @@ __gen_unpack_uint(const uint8_t *restrict cl, uint32_t start, uint32_t end)
 {
    uint64_t val = 0;
    const int width = end - start + 1;
-   const uint64_t mask = (width == 64 ? ~0 : (1ull << width) - 1 );
+   const uint64_t mask = (width == 64 ? ~0ull : (1ull << width) - 1 );
 
    for (unsigned byte = start / 8; byte <= end / 8; byte++) {
       val |= ((uint64_t) cl[byte]) << ((byte - start / 8) * 8);
@@ -118,9 +123,380 @@ __gen_unpack_sint(const uint8_t *restrict cl, uint32_t start, uint32_t end)
         struct AGX_ ## T name;                         \\
         AGX_ ## T ## _unpack((uint8_t *)(src), &name)
 
-#define bl_print(fp, T, var, indent)                   \\
-        AGX_ ## T ## _print(fp, &(var), indent)
+#define bl_print(out, T, var, indent, data)            \\
+        AGX_ ## T ## _print(out, &(var), indent, data)
 
+#define bl_json(out, T, var, data)                     \\
+        AGX_ ## T ## _json(out, &(var), data)
+
+#define bl_addresses(T, var, data)                     \\
+        AGX_ ## T ## _addresses(&(var), data)
+
+/* Address fields in JSON output go through this hook, so a decoder can
+ * resolve them against its own view of memory by defining it (and passing
+ * its state as data) before including this file */
+#ifndef __gen_json_address
+#define __gen_json_address(out, data, va) agx_sink_u64(out, va)
+#endif
+
+/* Likewise for address fields in text output, printed raw by default */
+#ifndef __gen_print_address
+#define __gen_print_address(out, data, va) __gen_print_hex(out, va)
+#endif
+
+/* Called with the name and value of every address field by the _addresses
+ * functions, for decoders tracking what points where */
+#ifndef __gen_visit_address
+#define __gen_visit_address(data, name, va)
+#endif
+
+/* Reflection: every struct is also described by a constant table of its
+ * fields, for tools working on any packet without per-struct code. See
+ * agx_unpack_fields and friends at the end of the file. */
+
+enum agx_field_type {
+   AGX_FIELD_UINT,
+   AGX_FIELD_HEX,
+   AGX_FIELD_INT,
+   AGX_FIELD_BOOL,
+   AGX_FIELD_FLOAT,
+   AGX_FIELD_UINT_FLOAT,
+   AGX_FIELD_ADDRESS,
+   AGX_FIELD_ENUM,
+   AGX_FIELD_STRUCT,
+};
+
+enum agx_field_modifier {
+   AGX_MODIFIER_NONE,
+   AGX_MODIFIER_SHR,
+   AGX_MODIFIER_MINUS,
+   AGX_MODIFIER_ALIGN,
+   AGX_MODIFIER_LOG2,
+};
+
+struct agx_enum_value {
+   const char *name;
+   int value;
+};
+
+struct agx_enum_info {
+   const char *name;
+   const struct agx_enum_value *values;
+   unsigned value_count;
+};
+
+struct agx_struct_info;
+
+struct agx_field_info {
+   /* As in the XML, and as the member of the unpacked struct */
+   const char *name;
+   const char *key;
+
+   /* Bits in the packet, inclusive */
+   uint16_t start, end;
+
+   uint8_t type;
+   uint8_t modifier;
+   uint32_t modifier_value;
+
+   /* For enum and struct types */
+   const struct agx_enum_info *enum_info;
+   const struct agx_struct_info *struct_info;
+};
+
+struct agx_struct_info {
+   const char *name;
+   unsigned id, length;
+
+   const struct agx_field_info *fields;
+   unsigned field_count;
+
+   /* Per 32-bit word, the bits no field covers */
+   const uint32_t *reserved;
+};
+
+static inline void
+__gen_print_hex(struct agx_sink *out, uint64_t va)
+{
+   agx_sink_lit(out, "0x");
+   agx_sink_hex(out, va, 0, false);
+}
+
+static inline void
+__gen_json_float(struct agx_sink *out, float f)
+{
+   if (isfinite(f))
+      agx_sink_printf(out, "%.9g", f);
+   else
+      agx_sink_lit(out, "null");
+}
+
+"""
+
+reflection_functions = """
+/* Unpacks every field of a packet into values, in table order. Each field is
+ * read from an 8-byte window at its first byte, so every iteration does the
+ * same work. Struct fields are left zero, see their struct_info. */
+static inline void
+agx_unpack_fields(const struct agx_struct_info *info, const uint8_t *cl, uint64_t *values)
+{
+   uint8_t padded[AGX_MAX_LENGTH + 8] = { 0 };
+   memcpy(padded, cl, info->length);
+
+   for (unsigned i = 0; i < info->length / 4; ++i) {
+      uint32_t word;
+      memcpy(&word, padded + i * 4, 4);
+
+      if (word & info->reserved[i])
+         fprintf(stderr, "XXX: Invalid field of %s unpacked at word %u\\n", info->name, i);
+   }
+
+   for (unsigned i = 0; i < info->field_count; ++i) {
+      const struct agx_field_info *f = &info->fields[i];
+      unsigned width = f->end - f->start + 1;
+      uint64_t v;
+
+      memcpy(&v, padded + f->start / 8, 8);
+      v = (v >> (f->start % 8)) & (width >= 64 ? ~0ull : (1ull << width) - 1);
+
+      if (f->type == AGX_FIELD_INT)
+         v = (uint64_t) ((int64_t) (v << (64 - width)) >> (64 - width));
+
+      if (f->modifier == AGX_MODIFIER_SHR)
+         v <<= f->modifier_value;
+      else if (f->modifier == AGX_MODIFIER_MINUS)
+         v += f->modifier_value;
+      else if (f->modifier == AGX_MODIFIER_LOG2)
+         v = 1ull << v;
+
+      values[i] = f->type == AGX_FIELD_STRUCT ? 0 : v;
+   }
+}
+
+static inline const char *
+agx_enum_as_str(const struct agx_enum_info *info, uint64_t v)
+{
+   for (unsigned i = 0; i < info->value_count; ++i) {
+      if (info->values[i].value == (int) v)
+         return info->values[i].name;
+   }
+
+   return "XXX: INVALID";
+}
+
+static inline const struct agx_field_info *
+agx_find_field(const struct agx_struct_info *info, const char *name)
+{
+   for (unsigned i = 0; i < info->field_count; ++i) {
+      if (!strcmp(info->fields[i].name, name) || !strcmp(info->fields[i].key, name))
+         return &info->fields[i];
+   }
+
+   return NULL;
+}
+
+/* Prints an unpacked value as the struct's _print function would */
+static inline void
+agx_print_value(struct agx_sink *out, const struct agx_field_info *f, uint64_t v, void *data)
+{
+   switch (f->type) {
+   case AGX_FIELD_ADDRESS:
+      __gen_print_address(out, data, v);
+      break;
+   case AGX_FIELD_ENUM:
+      agx_sink_puts(out, agx_enum_as_str(f->enum_info, v));
+      break;
+   case AGX_FIELD_INT:
+      agx_sink_i64(out, (int64_t) v);
+      break;
+   case AGX_FIELD_BOOL:
+      agx_sink_puts(out, v ? "true" : "false");
+      break;
+   case AGX_FIELD_FLOAT:
+      agx_sink_float(out, uif(v));
+      break;
+   case AGX_FIELD_UINT_FLOAT:
+      agx_sink_lit(out, "0x");
+      agx_sink_hex(out, v, 0, true);
+      agx_sink_lit(out, " (");
+      agx_sink_float(out, uif(v));
+      agx_sink_putc(out, ')');
+      break;
+   case AGX_FIELD_UINT:
+      if (f->end - f->start < 32) {
+         agx_sink_u64(out, v);
+         break;
+      }
+      /* fallthrough */
+   default:
+      agx_sink_lit(out, "0x");
+      agx_sink_hex(out, v, 0, false);
+      break;
+   }
+}
+
+static inline bool
+agx_field_differs(const struct agx_field_info *f, uint64_t a, uint64_t b)
+{
+   return f->type == AGX_FIELD_FLOAT ? uif(a) != uif(b) : a != b;
+}
+
+static inline void
+agx_print_fields(struct agx_sink *out, const struct agx_struct_info *info,
+                 const uint8_t *cl, unsigned indent, void *data)
+{
+   uint64_t values[AGX_MAX_FIELDS];
+   agx_unpack_fields(info, cl, values);
+
+   for (unsigned i = 0; i < info->field_count; ++i) {
+      const struct agx_field_info *f = &info->fields[i];
+
+      agx_sink_indent(out, indent);
+      agx_sink_puts(out, f->name);
+
+      if (f->type == AGX_FIELD_STRUCT) {
+         agx_sink_lit(out, ":\\n");
+         agx_print_fields(out, f->struct_info, cl + f->start / 8, indent + 2, data);
+         continue;
+      }
+
+      agx_sink_lit(out, ": ");
+      agx_print_value(out, f, values[i], data);
+      agx_sink_putc(out, '\\n');
+   }
+}
+
+/* Like print, but only the fields that differ from old, with the old value */
+static inline void
+agx_diff_fields(struct agx_sink *out, const struct agx_struct_info *info,
+                const uint8_t *old_cl, const uint8_t *cl, unsigned indent, void *data)
+{
+   uint64_t old[AGX_MAX_FIELDS], values[AGX_MAX_FIELDS];
+   agx_unpack_fields(info, old_cl, old);
+   agx_unpack_fields(info, cl, values);
+
+   for (unsigned i = 0; i < info->field_count; ++i) {
+      const struct agx_field_info *f = &info->fields[i];
+
+      if (f->type == AGX_FIELD_STRUCT) {
+         agx_diff_fields(out, f->struct_info, old_cl + f->start / 8,
+                         cl + f->start / 8, indent, data);
+         continue;
+      }
+
+      if (!agx_field_differs(f, old[i], values[i]))
+         continue;
+
+      agx_sink_indent(out, indent);
+      agx_sink_puts(out, f->name);
+      agx_sink_lit(out, ": ");
+      agx_print_value(out, f, values[i], data);
+      agx_sink_lit(out, " (was ");
+      agx_print_value(out, f, old[i], data);
+      agx_sink_lit(out, ")\\n");
+   }
+}
+
+static inline void
+agx_print_packed(struct agx_sink *out, unsigned id, const uint8_t *cl, unsigned indent, void *data)
+{
+   if (id < AGX_NUM_STRUCTS && agx_struct_infos[id])
+      agx_print_fields(out, agx_struct_infos[id], cl, indent, data);
+}
+
+static inline void
+agx_diff_packed(struct agx_sink *out, unsigned id, const uint8_t *old_cl, const uint8_t *cl, unsigned indent, void *data)
+{
+   if (id < AGX_NUM_STRUCTS && agx_struct_infos[id])
+      agx_diff_fields(out, agx_struct_infos[id], old_cl, cl, indent, data);
+}
+"""
+
+bench_program = """
+/* Generated code, see gen_pack.py --bench
+ *
+ * Round-trips random values of every packable struct through pack and
+ * unpack, checking they survive and the reserved bits stay clear, then
+ * measures packs and unpacks per second.
+ *
+ * This file has been generated, do not hand edit.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "agx_pack.h"
+
+/* Distinct inputs cycled through while timing, so each iteration does not
+ * pack the same values */
+#define BENCH_SAMPLES 256
+
+static uint64_t bench_state = 0x9e3779b97f4a7c15ull;
+static unsigned bench_failures = 0;
+
+/* xorshift64*, deterministic so failures reproduce */
+static uint64_t
+bench_random(void)
+{
+   bench_state ^= bench_state >> 12;
+   bench_state ^= bench_state << 25;
+   bench_state ^= bench_state >> 27;
+   return bench_state * 0x2545f4914f6cdd1dull;
+}
+
+static double
+bench_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+bench_check(const struct agx_struct_info *info, const uint8_t *cl,
+            const void *values, const void *unpacked, size_t size, unsigned sample)
+{
+   for (unsigned i = 0; i < info->length / 4; ++i) {
+      uint32_t word;
+      memcpy(&word, cl + i * 4, 4);
+
+      if (word & info->reserved[i]) {
+         fprintf(stderr, "%s: sample %u sets reserved bits %08x of word %u\\n",
+                 info->name, sample, word & info->reserved[i], i);
+         bench_failures++;
+      }
+   }
+
+   if (memcmp(values, unpacked, size)) {
+      fprintf(stderr, "%s: sample %u does not survive pack and unpack\\n",
+              info->name, sample);
+      bench_failures++;
+   }
+}
+
+static void
+bench_report(const struct agx_struct_info *info, unsigned iterations,
+             double pack, double unpack)
+{
+   printf("%-24s %3u bytes %10.1f M packs/s %10.1f M unpacks/s\\n",
+          info->name, info->length, iterations / pack * 1e-6,
+          iterations / unpack * 1e-6);
+}
+"""
+
+bench_main = """
+int
+main(int argc, char **argv)
+{
+   unsigned iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : (1 << 22);
+
+%s
+   if (bench_failures) {
+      fprintf(stderr, "%%u round trip failures\\n", bench_failures);
+      return 1;
+   }
+
+   return 0;
+}
 """
 
 def to_alphanum(name):
@@ -169,7 +545,7 @@ def num_from_str(num_str):
     if num_str.lower().startswith('0x'):
         return int(num_str, base=16)
     else:
-        assert(not num_str.startswith('0') and 'octals numbers not allowed')
+        assert((num_str == '0' or not num_str.startswith('0')) and 'octals numbers not allowed')
         return int(num_str)
 
 MODIFIERS = ["shr", "minus", "align", "log2"]
@@ -227,6 +603,11 @@ class Field(object):
 
         self.default = attrs.get("default")
 
+        # Fixed fields always hold their default, which packing folds in
+        self.fixed = attrs.get("fixed") == "true"
+        if self.fixed and (self.default is None or self.type not in ["uint", "hex"]):
+            print("#error fixed field {} needs a numeric default".format(self.name))
+
         # Map enum values
         if self.type in self.parser.enums and self.default is not None:
             self.default = safe_name('{}_{}_{}'.format(global_prefix, self.type, self.default)).upper()
@@ -260,6 +641,41 @@ class Field(object):
             name = prefixed_upper_name(self.prefix, value.name)
             print("#define %-40s %d" % (name, value.value))
 
+    def emit_info(self, parser):
+        types = {
+            "uint": "AGX_FIELD_UINT",
+            "hex": "AGX_FIELD_HEX",
+            "int": "AGX_FIELD_INT",
+            "bool": "AGX_FIELD_BOOL",
+            "float": "AGX_FIELD_FLOAT",
+            "uint/float": "AGX_FIELD_UINT_FLOAT",
+            "address": "AGX_FIELD_ADDRESS",
+        }
+
+        enum_info = struct_info = "NULL"
+
+        if self.type in parser.enums:
+            type = "AGX_FIELD_ENUM"
+            enum_info = "&{}_info".format(enum_name(self.type))
+        elif self.type in parser.structs:
+            type = "AGX_FIELD_STRUCT"
+            struct_info = "&{}_info".format(parser.gen_prefix(safe_name(self.type.upper())))
+        else:
+            type = types[self.type]
+
+            # Read from an 8-byte window at the first byte of the field
+            if (self.start % 8) + (self.end - self.start + 1) > 64:
+                print("#error field {} too wide to unpack generically".format(self.name))
+
+        modifier, value = "AGX_MODIFIER_NONE", 0
+        if self.modifier:
+            modifier = "AGX_MODIFIER_" + self.modifier[0].upper()
+            value = self.modifier[1] if len(self.modifier) > 1 else 0
+
+        print('   {{ "{}", "{}", {}, {}, {}, {}, {}, {}, {} }},'.format(
+            self.human_name, self.name, self.start, self.end,
+            type, modifier, value, enum_info, struct_info))
+
     def overlaps(self, field):
         return self != field and max(self.start, field.start) <= min(self.end, field.end)
 
@@ -345,91 +761,263 @@ class Group(object):
                     words[b] = self.Word()
                 words[b].contributors.append(contributor)
 
-    def emit_pack_function(self):
-        self.get_length()
+    # Value stored in the packed bits of a field, before shifting
+    def pack_value(self, field, path):
+        value = "values->{}".format(path)
+        if field.modifier is not None:
+            if field.modifier[0] == "shr":
+                value = "{} >> {}".format(value, field.modifier[1])
+            elif field.modifier[0] == "minus":
+                value = "{} - {}".format(value, field.modifier[1])
+            elif field.modifier[0] == "align":
+                value = "ALIGN_POT({}, {})".format(value, field.modifier[1])
+            elif field.modifier[0] == "log2":
+                value = "util_logbase2({})".format(value)
 
-        words = {}
-        self.collect_words(self.fields, 0, '', words)
+        return value if not ' ' in value else '(' + value + ')'
 
-        # Validate the modifier is lossless
-        for field in self.fields:
-            if field.modifier is None:
-                continue
+    def constant_value(self, field):
+        return field.exact if field.exact is not None else num_from_str(field.default)
 
-            assert(field.exact is None)
+    # A single assertion that every field fits its bits, modifiers are
+    # lossless and fixed fields hold their value, replacing an assert per
+    # field. Compiled out with NDEBUG.
+    def emit_pack_check(self):
+        fieldrefs = []
+        self.collect_fields(self.fields, 0, '', fieldrefs)
+        terms = []
 
-            if field.modifier[0] == "shr":
-                shift = field.modifier[1]
-                mask = hex((1 << shift) - 1)
-                print("   assert((values->{} & {}) == 0);".format(field.name, mask))
-            elif field.modifier[0] == "minus":
-                print("   assert(values->{} >= {});".format(field.name, field.modifier[1]))
-            elif field.modifier[0] == "log2":
-                print("   assert(util_is_power_of_two_nonzero(values->{}));".format(field.name))
+        for fieldref in fieldrefs:
+            field = fieldref.field
+            width = fieldref.end - fieldref.start + 1
+            mask = (1 << width) - 1
+            val = "values->{}".format(fieldref.path)
 
-        for index in range(self.length // 4):
-            # Handle MBZ words
-            if not index in words:
-                print("   cl[%2d] = 0;" % index)
+            if field.exact is not None:
+                continue
+            elif field.fixed:
+                terms.append("({} ^ {})".format(val, hex(self.constant_value(field))))
                 continue
 
-            word = words[index]
+            if field.modifier is not None:
+                if field.modifier[0] == "shr":
+                    terms.append("({} & {})".format(val, hex((1 << field.modifier[1]) - 1)))
+                elif field.modifier[0] == "log2":
+                    terms.append("!util_is_power_of_two_nonzero({})".format(val))
 
-            word_start = index * 32
+            # Nothing to check if the member cannot hold more bits
+            if width >= 64 or field.type in ["bool", "float"]:
+                continue
+            elif field.type in ["uint", "hex"] and field.modifier is None and width in [32, 33]:
+                continue
 
-            v = None
-            prefix = "   cl[%2d] =" % index
+            value = self.pack_value(field, fieldref.path)
+
+            if field.type == "int":
+                terms.append("((uint64_t) ((int64_t) {} + {}) & ~{}ull)".format(value, hex(1 << (width - 1)), hex(mask)))
+            else:
+                terms.append("((uint64_t) {} & ~{}ull)".format(value, hex(mask)))
+
+        if terms:
+            print("   assert(!({}));".format(" |\n            ".join(terms)))
+
+    # Packs with the bits of exact and fixed fields folded into one constant
+    # per word, ORing in only the rest, without any validation
+    def emit_pack_function(self):
+        self.get_length()
+
+        words = {}
+        self.collect_words(self.fields, 0, '', words)
+
+        for index in range((self.length + 3) // 4):
+            word = words.get(index, self.Word())
+            word_start = index * 32
+            constant = 0
+            terms = []
 
             for contributor in word.contributors:
                 field = contributor.field
-                name = field.name
                 start = contributor.start
                 end = contributor.end
+
+                if field.exact is not None or field.fixed:
+                    constant |= ((self.constant_value(field) << start) >> word_start) & 0xffffffff
+                    continue
+
                 contrib_word_start = (start // 32) * 32
                 start -= contrib_word_start
                 end -= contrib_word_start
+                value = self.pack_value(field, contributor.path)
 
-                value = str(field.exact) if field.exact is not None else "values->{}".format(contributor.path)
-                if field.modifier is not None:
-                    if field.modifier[0] == "shr":
-                        value = "{} >> {}".format(value, field.modifier[1])
-                    elif field.modifier[0] == "minus":
-                        value = "{} - {}".format(value, field.modifier[1])
-                    elif field.modifier[0] == "align":
-                        value = "ALIGN_POT({}, {})".format(value, field.modifier[1])
-                    elif field.modifier[0] == "log2":
-                        value = "util_logbase2({})".format(value)
-
-                if field.type in ["uint", "hex", "address"]:
-                    s = "__gen_uint(%s, %d, %d)" % \
-                        (value, start, end)
-                elif field.type in self.parser.enums:
-                    s = "__gen_uint(%s, %d, %d)" % \
-                        (value, start, end)
+                if field.type in ["uint", "hex", "address", "bool"] or field.type in self.parser.enums:
+                    s = "(uint64_t) {}".format(value)
+                    if start:
+                        s = "{} << {}".format(s, start)
                 elif field.type == "int":
-                    s = "__gen_sint(%s, %d, %d)" % \
-                        (value, start, end)
-                elif field.type == "bool":
-                    s = "__gen_uint(%s, %d, %d)" % \
-                        (value, start, end)
+                    s = "((uint32_t) {} << {} & {})".format(value, start, hex((2 << end) - 1))
                 elif field.type == "float":
                     assert(start == 0 and end == 31)
-                    s = "__gen_uint(fui({}), 0, 32)".format(value)
+                    s = "fui({})".format(value)
                 else:
                     s = "#error unhandled field {}, type {}".format(contributor.path, field.type)
 
-                if not s == None:
-                    shift = word_start - contrib_word_start
-                    if shift:
-                        s = "%s >> %d" % (s, shift)
+                shift = word_start - contrib_word_start
+                if shift:
+                    s = "({}) >> {}".format(s, shift)
+
+                terms.append(s)
+
+            if constant or not terms:
+                terms.insert(0, hex(constant))
+
+            # A trailing partial word is written bytewise, to not overrun
+            if (index + 1) * 4 > self.length:
+                print("   {")
+                print("      const uint32_t tail = %s;" % " |\n                            ".join(terms))
+                print("      memcpy(cl + %d, &tail, %d);" % (index, self.length % 4))
+                print("   }")
+            else:
+                print("   cl[%2d] = %s;" % (index, " |\n            ".join(terms)))
+
+    # Macros expanding to the packed words as integer constant expressions.
+    # <name>_PACKED takes the fields without a default in order, along with
+    # enum fields with one, as those select a mode that other arguments may
+    # depend on. <name>_PACKED_WITH takes every field but the fixed ones.
+    # Out of range values are truncated to their field, so each has a
+    # matching _FITS macro that is true if the same arguments fit, for use
+    # in a _Static_assert. C cannot bit cast in a constant expression, so
+    # float fields take their IEEE bits as <field>_bits, and passing a float
+    # instead fails to compile.
+    def emit_packed_macro(self, name):
+        fieldrefs = []
+        self.collect_fields(self.fields, 0, '', fieldrefs)
+
+        if any(f.field.modifier and f.field.modifier[0] == "log2" for f in fieldrefs):
+            return
+
+        args = self.emit_packed_form(name + "_PACKED", fieldrefs, False)
+
+        self.emit_packed_form(name + "_PACKED_WITH", fieldrefs, True, args)
+        print("")
+
+    def emit_packed_form(self, name, fieldrefs, with_defaults, skip_if = None):
+        args = []
+        checks = []
+        words = [[0, []] for i in range((self.length + 3) // 4)]
+
+        for fieldref in fieldrefs:
+            field = fieldref.field
+            width = fieldref.end - fieldref.start + 1
+            mask = (1 << width) - 1
+            taken = field.default is None or \
+                    field.type not in ["uint", "hex", "int", "bool", "float"] or \
+                    with_defaults
+
+            if field.exact is not None or field.fixed or \
+               (not taken and field.modifier is None and
+                field.type in ["uint", "hex", "int", "bool"]):
+                if field.type == "bool" and field.exact is None:
+                    value = int(field.default == "true")
+                else:
+                    value = self.constant_value(field)
+
+                for index in range(fieldref.start // 32, fieldref.end // 32 + 1):
+                    words[index][0] |= (((value & mask) << fieldref.start) >> (index * 32)) & 0xffffffff
+                continue
+            elif taken and field.type == "float":
+                # Bitwise OR with an integer does not compile for a float,
+                # so a float cannot be passed for its bits by mistake
+                arg = fieldref.path.replace('.', '_') + "_bits"
+                args.append(arg)
+                arg = "({}) | 0u".format(arg)
+            elif taken:
+                arg = fieldref.path.replace('.', '_')
+                args.append(arg)
+            elif field.type == "float":
+                arg = hex(struct.unpack('<I', struct.pack('<f', float(field.default)))[0])
+            else:
+                arg = field.default
+
+            value = "(" + arg + ")"
+            if field.modifier is not None:
+                if field.modifier[0] == "shr":
+                    if taken:
+                        checks.append("((uint64_t) {} & {}ull)".format(value, hex((1 << field.modifier[1]) - 1)))
+                    value = "({} >> {})".format(value, field.modifier[1])
+                elif field.modifier[0] == "minus":
+                    value = "({} - {})".format(value, field.modifier[1])
+                elif field.modifier[0] == "align":
+                    value = "ALIGN_POT({}, {})".format(value, field.modifier[1])
+
+            if taken and width < 64:
+                if field.type == "int":
+                    checks.append("((uint64_t) ((int64_t) {} + {}) & ~{}ull)".format(value, hex(1 << (width - 1)), hex(mask)))
+                else:
+                    checks.append("((uint64_t) {} & ~{}ull)".format(value, hex(mask)))
+
+            value = "((uint64_t) {} & {}ull)".format(value, hex(mask))
 
-                    if contributor == word.contributors[-1]:
-                        print("%s %s;" % (prefix, s))
-                    else:
-                        print("%s %s |" % (prefix, s))
-                    prefix = "           "
+            for index in range(fieldref.start // 32, fieldref.end // 32 + 1):
+                shift = fieldref.start - index * 32
+                if shift > 0:
+                    words[index][1].append("{} << {}".format(value, shift))
+                elif shift < 0:
+                    words[index][1].append("{} >> {}".format(value, -shift))
+                else:
+                    words[index][1].append(value)
+
+        if args == skip_if:
+            return None
+
+        if skip_if is not None:
+            print("")
+
+        print("#define {}({}) {{ \\".format(name, ", ".join(args)))
+
+        for index, (constant, terms) in enumerate(words):
+            if constant or not terms:
+                terms.insert(0, hex(constant))
+
+            sep = " }\n" if index == len(words) - 1 else ", \\\n"
+            print("   (uint32_t) ({}){}".format(" | ".join(terms), sep), end = '')
+
+        print("#define {}_FITS({}) \\".format(name, ", ".join(args)))
+        print("   (!({}))".format(" | \\\n      ".join(checks) if checks else "0"))
+        return args
+
+    # Fills values with random contents that pack losslessly: every field in
+    # range, modifiers respected and fixed fields at their value
+    def emit_random_function(self):
+        fieldrefs = []
+        self.collect_fields(self.fields, 0, '', fieldrefs)
 
-            continue
+        for fieldref in fieldrefs:
+            field = fieldref.field
+            width = fieldref.end - fieldref.start + 1
+            mask = hex((1 << width) - 1) + "ull"
+            value = "(bench_random() & {})".format(mask)
+
+            if field.exact is not None:
+                continue
+            elif field.fixed:
+                value = hex(self.constant_value(field))
+            elif field.type == "bool":
+                value = "bench_random() & 1"
+            elif field.type == "float":
+                value = "uif(bench_random())"
+            elif field.type == "int":
+                value = "(int64_t) (bench_random() << {}) >> {}".format(64 - width, 64 - width)
+            elif field.modifier is not None:
+                if field.modifier[0] == "shr":
+                    value = "{} << {}".format(value, field.modifier[1])
+                elif field.modifier[0] == "minus":
+                    value = "{} + {}".format(value, field.modifier[1])
+                elif field.modifier[0] == "align":
+                    value = "{} & ~{}ull".format(value, hex(field.modifier[1] - 1))
+                elif field.modifier[0] == "log2":
+                    value = "1 << (bench_random() % {})".format(min(1 << width, 31))
+
+            print("   values->{} = {};".format(fieldref.path, value))
 
     # Given a field (start, end) contained in word `index`, generate the 32-bit
     # mask of present bits relative to the word
@@ -443,17 +1031,23 @@ class Group(object):
         count = (end - start + 1)
         return (((1 << count) - 1) << start)
 
-    def emit_unpack_function(self):
-        # First, verify there is no garbage in unused bits
+    # Per word, the bits no field covers
+    def reserved_masks(self):
         words = {}
         self.collect_words(self.fields, 0, '', words)
+        reserved = []
 
         for index in range(self.length // 4):
-            base = index * 32
             word = words.get(index, self.Word())
             masks = [self.mask_for_word(index, c.start, c.end) for c in word.contributors]
-            mask = reduce(lambda x,y: x | y, masks, 0)
+            reserved.append(reduce(lambda x,y: x | y, masks, 0) ^ 0xffffffff)
+
+        return reserved
 
+    def emit_unpack_function(self):
+        # First, verify there is no garbage in unused bits
+        for index, reserved in enumerate(self.reserved_masks()):
+            mask = reserved ^ 0xffffffff
             ALL_ONES = 0xffffffff
 
             if mask != ALL_ONES:
@@ -499,34 +1093,123 @@ class Group(object):
                 mask = hex(field.modifier[1] - 1)
                 print('   assert(!(values->{} & {}));'.format(fieldref.path, mask))
 
+    # Prints a literal lead ("Name: ") followed by the value of a field
+    def emit_print_value(self, field, val, lead, ind = '   '):
+        def lit(text):
+            print(ind + 'agx_sink_lit(out, "{}");'.format(text))
+
+        if field.type == "address":
+            lit(lead)
+            print(ind + '__gen_print_address(out, data, {});'.format(val))
+        elif field.type in self.parser.enums:
+            lit(lead)
+            print(ind + 'agx_sink_puts(out, {}_as_str({}));'.format(enum_name(field.type), val))
+        elif field.type == "int":
+            lit(lead)
+            print(ind + 'agx_sink_i64(out, {});'.format(val))
+        elif field.type == "bool":
+            lit(lead)
+            print(ind + 'agx_sink_puts(out, {} ? "true" : "false");'.format(val))
+        elif field.type == "float":
+            lit(lead)
+            print(ind + 'agx_sink_float(out, {});'.format(val))
+        elif field.type == "hex" or (field.type == "uint" and (field.end - field.start) >= 32):
+            lit(lead + '0x')
+            print(ind + 'agx_sink_hex(out, {}, 0, false);'.format(val))
+        elif field.type == "uint/float":
+            lit(lead + '0x')
+            print(ind + 'agx_sink_hex(out, {}, 0, true);'.format(val))
+            lit(' (')
+            print(ind + 'agx_sink_float(out, uif({}));'.format(val))
+            print(ind + 'agx_sink_putc(out, \')\');')
+        else:
+            lit(lead)
+            print(ind + 'agx_sink_u64(out, {});'.format(val))
+
     def emit_print_function(self):
         for field in self.fields:
-            convert = None
             name, val = field.human_name, 'values->{}'.format(field.name)
+            print('   agx_sink_indent(out, indent);')
 
             if field.type in self.parser.structs:
                 pack_name = self.parser.gen_prefix(safe_name(field.type)).upper()
-                print('   fprintf(fp, "%*s{}:\\n", indent, "");'.format(field.human_name))
-                print("   {}_print(fp, &values->{}, indent + 2);".format(pack_name, field.name))
+                print('   agx_sink_lit(out, "{}:\\n");'.format(name))
+                print("   {}_print(out, &values->{}, indent + 2, data);".format(pack_name, field.name))
+                continue
+
+            self.emit_print_value(field, val, name + ': ')
+            print('   agx_sink_putc(out, \'\\n\');')
+
+    def emit_json_function(self):
+        print('   agx_sink_putc(out, \'{\');')
+
+        for i, field in enumerate(self.fields):
+            sep = ',' if i > 0 else ''
+            print('   agx_sink_lit(out, "{}\\"{}\\":");'.format(sep, field.name))
+            val = 'values->{}'.format(field.name)
+
+            if field.type in self.parser.structs:
+                pack_name = self.parser.gen_prefix(safe_name(field.type)).upper()
+                print("   {}_json(out, &{}, data);".format(pack_name, val))
             elif field.type == "address":
-                # TODO resolve to name
-                print('   fprintf(fp, "%*s{}: 0x%" PRIx64 "\\n", indent, "", {});'.format(name, val))
+                print('   __gen_json_address(out, data, {});'.format(val))
             elif field.type in self.parser.enums:
-                print('   fprintf(fp, "%*s{}: %s\\n", indent, "", {}_as_str({}));'.format(name, enum_name(field.type), val))
+                print('   agx_sink_putc(out, \'"\');')
+                print('   agx_sink_puts(out, {}_as_str({}));'.format(enum_name(field.type), val))
+                print('   agx_sink_putc(out, \'"\');')
             elif field.type == "int":
-                print('   fprintf(fp, "%*s{}: %d\\n", indent, "", {});'.format(name, val))
+                print('   agx_sink_i64(out, {});'.format(val))
             elif field.type == "bool":
-                print('   fprintf(fp, "%*s{}: %s\\n", indent, "", {} ? "true" : "false");'.format(name, val))
+                print('   agx_sink_puts(out, {} ? "true" : "false");'.format(val))
             elif field.type == "float":
-                print('   fprintf(fp, "%*s{}: %f\\n", indent, "", {});'.format(name, val))
-            elif field.type in ["uint", "hex"] and (field.end - field.start) >= 32:
-                print('   fprintf(fp, "%*s{}: 0x%" PRIx64 "\\n", indent, "", {});'.format(name, val))
-            elif field.type == "hex":
-                print('   fprintf(fp, "%*s{}: 0x%" PRIx32 "\\n", indent, "", {});'.format(name, val))
-            elif field.type == "uint/float":
-                print('   fprintf(fp, "%*s{}: 0x%X (%f)\\n", indent, "", {}, uif({}));'.format(name, val, val))
+                print('   __gen_json_float(out, {});'.format(val))
             else:
-                print('   fprintf(fp, "%*s{}: %u\\n", indent, "", {});'.format(name, val))
+                print('   agx_sink_u64(out, {});'.format(val))
+
+        print('   agx_sink_putc(out, \'}\');')
+
+    def emit_addresses_function(self):
+        for field in self.fields:
+            val = 'values->{}'.format(field.name)
+
+            if field.type in self.parser.structs:
+                pack_name = self.parser.gen_prefix(safe_name(field.type)).upper()
+                print("   {}_addresses(&{}, data);".format(pack_name, val))
+            elif field.type == "address":
+                print('   __gen_visit_address(data, "{}", {});'.format(field.human_name, val))
+
+# How a packet is recognized in a stream, from the first word of the packet
+# read little-endian: it is one if the masked word equals the value
+class Match(object):
+    def __init__(self, attrs, id, length):
+        self.stream = attrs["stream"]
+        self.value = num_from_str(attrs["value"])
+        self.mask = num_from_str(attrs.get("mask", "0xffffffff"))
+        self.id = id
+        self.length = int(attrs["length"]) if "length" in attrs else length
+
+        if self.value & ~self.mask:
+            print("#error {} matches bits outside its mask".format(id))
+
+    def bits(self):
+        return bin(self.mask).count("1")
+
+    def masks_byte(self, i):
+        return ((self.mask >> (i * 8)) & 0xff) == 0xff
+
+    def byte(self, i):
+        return (self.value >> (i * 8)) & 0xff
+
+    def emit_check(self, indent):
+        if self.mask == 0xffffffff:
+            cond = "w == 0x{:x}".format(self.value)
+        else:
+            cond = "(w & 0x{:x}) == 0x{:x}".format(self.mask, self.value)
+
+        print("{}if ({}) {{".format(indent, cond))
+        print("{}   *length = {};".format(indent, self.length))
+        print("{}   return {};".format(indent, self.id))
+        print("{}}}".format(indent))
 
 class Value(object):
     def __init__(self, attrs):
@@ -541,8 +1224,21 @@ class Parser(object):
 
         self.struct = None
         self.structs = {}
+        # Sequential IDs for structs, used to tag binary records
+        self.struct_count = 0
+        # Structs with an unpack function, dispatched by ID
+        self.unpackable = []
+        # Groups of those, for the benchmark
+        self.groups = []
         # Set of enum names we've seen.
         self.enums = set()
+        # Structs described by reflection tables, and their largest size
+        self.infos = []
+        self.max_length = 0
+        self.max_fields = 0
+        # Matches by stream, in document order, and the IDs of terminators
+        self.matches = {}
+        self.terminators = []
 
     def gen_prefix(self, name):
         return '{}_{}'.format(global_prefix.upper(), name)
@@ -561,12 +1257,20 @@ class Parser(object):
                 self.group.length = int(attrs["size"])
             self.group.align = int(attrs["align"]) if "align" in attrs else None
             self.structs[attrs["name"]] = self.group
+            self.struct_matches = []
+        elif name == "match":
+            self.struct_matches.append(attrs)
+        elif name == "terminator":
+            id = self.gen_prefix(safe_name(attrs["name"].upper())) + "_ID"
+            self.terminators.append(id)
+            self.add_match(Match(attrs, id, int(attrs["size"])))
         elif name == "field":
             self.group.fields.append(Field(self, attrs))
             self.values = []
         elif name == "enum":
             self.values = []
             self.enum = safe_name(attrs["name"])
+            self.enum_human = attrs["name"]
             self.enums.add(attrs["name"])
             if "prefix" in attrs:
                 self.prefix = attrs["prefix"]
@@ -578,6 +1282,8 @@ class Parser(object):
     def end_element(self, name):
         if name == "struct":
             self.emit_struct()
+            for attrs in self.struct_matches:
+                self.add_match(Match(attrs, self.struct + "_ID", self.group.length))
             self.struct = None
             self.group = None
         elif name  == "field":
@@ -586,6 +1292,9 @@ class Parser(object):
             self.emit_enum()
             self.enum = None
         elif name == "blxml":
+            print('#define AGX_NUM_STRUCTS {}\n'.format(self.struct_count))
+            self.emit_packed_dispatch()
+            self.emit_matchers()
             print('#endif')
 
     def emit_header(self, name):
@@ -611,17 +1320,26 @@ class Parser(object):
         print("};\n")
 
     def emit_pack_function(self, name, group):
+        print("static inline void\n%s_pack_unchecked(uint32_t * restrict cl,\n%sconst struct %s * restrict values)\n{" %
+              (name, ' ' * (len(name) + 16), name))
+
+        group.emit_pack_function()
+
+        print("}\n")
+
         print("static inline void\n%s_pack(uint32_t * restrict cl,\n%sconst struct %s * restrict values)\n{" %
               (name, ' ' * (len(name) + 6), name))
 
-        group.emit_pack_function()
+        group.emit_pack_check()
+        print("   %s_pack_unchecked(cl, values);" % name)
 
         print("}\n\n")
 
         print('#define {} {}'.format (name + "_LENGTH", self.group.length))
         if self.group.align != None:
             print('#define {} {}'.format (name + "_ALIGN", self.group.align))
-        print('struct {}_packed {{ uint32_t opaque[{}]; }};'.format(name.lower(), self.group.length // 4))
+        print('struct {}_packed {{ uint32_t opaque[{}]; }};'.format(name.lower(), (self.group.length + 3) // 4))
+        group.emit_packed_macro(name)
 
     def emit_unpack_function(self, name, group):
         print("static inline void")
@@ -634,21 +1352,167 @@ class Parser(object):
 
     def emit_print_function(self, name, group):
         print("static inline void")
-        print("{}_print(FILE *fp, const struct {} * values, unsigned indent)\n{{".format(name.upper(), name))
+        print("{}_print(struct agx_sink *out, const struct {} * values, unsigned indent, void *data)\n{{".format(name.upper(), name))
 
         group.emit_print_function()
 
         print("}\n")
 
+    def emit_info(self, name, group):
+        reserved = group.reserved_masks()
+        print("static const uint32_t {}_reserved[] = {{ {} }};\n".format(
+            name, ", ".join(hex(r) for r in reserved) if reserved else "0"))
+
+        print("static const struct agx_field_info {}_fields[] = {{".format(name))
+        for field in group.fields:
+            field.emit_info(self)
+        print("};\n")
+
+        print("static const struct agx_struct_info {}_info = {{".format(name))
+        print('   "{}", {}, {},'.format(group.label, name + "_ID", group.length))
+        print("   {}_fields, ARRAY_SIZE({}_fields), {}_reserved,".format(name, name, name))
+        print("};\n")
+
+        self.max_length = max(self.max_length, group.length)
+        self.max_fields = max(self.max_fields, len(group.fields))
+        self.infos.append(name)
+
+    def emit_json_function(self, name, group):
+        print("static inline void")
+        print("{}_json(struct agx_sink *out, const struct {} * values, void *data)\n{{".format(name.upper(), name))
+
+        group.emit_json_function()
+
+        print("}\n")
+
+    def emit_addresses_function(self, name, group):
+        print("static inline void")
+        print("{}_addresses(const struct {} * values, void *data)\n{{".format(name.upper(), name))
+
+        group.emit_addresses_function()
+
+        print("}\n")
+
     def emit_struct(self):
         name = self.struct
 
         self.emit_template_struct(self.struct, self.group)
         self.emit_header(name)
+        print('#define {} {}'.format(name + "_ID", self.struct_count))
+        self.struct_count += 1
         if self.no_direct_packing == False:
             self.emit_pack_function(self.struct, self.group)
             self.emit_unpack_function(self.struct, self.group)
+            self.unpackable.append(name)
+            self.groups.append((name, self.group))
         self.emit_print_function(self.struct, self.group)
+        self.emit_json_function(self.struct, self.group)
+        self.emit_addresses_function(self.struct, self.group)
+        self.emit_info(self.struct, self.group)
+
+    # Generic unpacking, printing and diffing of any struct from its table,
+    # and of packed structs given only their AGX_*_ID
+    def emit_packed_dispatch(self):
+        print("#define AGX_MAX_LENGTH {}".format(self.max_length))
+        print("#define AGX_MAX_FIELDS {}\n".format(self.max_fields))
+
+        print("static const struct agx_struct_info *agx_struct_infos[AGX_NUM_STRUCTS] = {")
+        for name in self.infos:
+            print("   [{}_ID] = &{}_info,".format(name, name))
+        print("};\n")
+
+        print(reflection_functions)
+
+    def add_match(self, match):
+        matches = self.matches.setdefault(match.stream, [])
+
+        for m in matches:
+            if m.value == match.value and m.mask == match.mask:
+                print("#error {} and {} match the same".format(m.id, match.id))
+
+        matches.append(match)
+
+    # Recognize packets of each stream in a few instructions. A switch on the
+    # byte telling the most packets apart picks the candidates, which are
+    # then tried most specific first. Terminators are numbered after the
+    # structs, and no match returns AGX_NO_MATCH with a zero length.
+    def emit_matchers(self):
+        for i, id in enumerate(self.terminators):
+            print('#define {} {}'.format(id, 0x100 + i))
+        print('#define AGX_NO_MATCH 0xFFFF\n')
+
+        for stream, matches in self.matches.items():
+            self.emit_matcher(stream, sorted(matches, key=lambda m: -m.bits()))
+
+    def emit_matcher(self, stream, matches):
+        def score(i):
+            keyed = [m.byte(i) for m in matches if m.masks_byte(i)]
+            return (len(keyed), len(set(keyed)), -i)
+
+        key = max(range(4), key=score)
+        values = sorted(set(m.byte(key) for m in matches if m.masks_byte(key)))
+        wildcards = [m for m in matches if not m.masks_byte(key)]
+
+        print("static inline unsigned")
+        print("agx_match_{}(const uint8_t *cl, unsigned *length)\n{{".format(safe_name(stream).lower()))
+        print("   uint32_t w = cl[0] | (cl[1] << 8) | (cl[2] << 16) | ((uint32_t) cl[3] << 24);\n")
+        print("   switch (cl[{}]) {{".format(key))
+
+        for value in values:
+            print("   case 0x{:02x}:".format(value))
+
+            for m in matches:
+                if not m.masks_byte(key) or m.byte(key) == value:
+                    m.emit_check('      ')
+
+            print("      break;")
+
+        if wildcards:
+            print("   default:")
+            for m in wildcards:
+                m.emit_check('      ')
+            print("      break;")
+
+        print("   }\n")
+        print("   *length = 0;")
+        print("   return AGX_NO_MATCH;")
+        print("}\n")
+
+    # Standalone program round-tripping and timing each packable struct
+    def emit_bench(self):
+        print(bench_program)
+
+        for name, group in self.groups:
+            print("static void\n{}_random(struct {} *values)\n{{".format(name, name))
+            print("   memset(values, 0, sizeof(*values));")
+            group.emit_random_function()
+            print("}\n")
+
+            print("static void\nbench_{}(unsigned iterations)\n{{".format(name))
+            print("   static struct {} values[BENCH_SAMPLES], unpacked[BENCH_SAMPLES];".format(name))
+            print("   static uint32_t cl[BENCH_SAMPLES][{}];".format((group.length + 3) // 4))
+            print("")
+            print("   for (unsigned i = 0; i < BENCH_SAMPLES; ++i) {")
+            print("      {}_random(&values[i]);".format(name))
+            print("      {}_pack(cl[i], &values[i]);".format(name))
+            print("      memset(&unpacked[i], 0, sizeof(unpacked[i]));")
+            print("      {}_unpack((const uint8_t *) cl[i], &unpacked[i]);".format(name))
+            print("      bench_check(&{}_info, (const uint8_t *) cl[i], &values[i],".format(name))
+            print("                  &unpacked[i], sizeof(values[i]), i);")
+            print("   }")
+            print("")
+            print("   double start = bench_now();")
+            print("   for (unsigned i = 0; i < iterations; ++i)")
+            print("      {}_pack_unchecked(cl[i % BENCH_SAMPLES], &values[i % BENCH_SAMPLES]);".format(name))
+            print("")
+            print("   double packed = bench_now();")
+            print("   for (unsigned i = 0; i < iterations; ++i)")
+            print("      {}_unpack((const uint8_t *) cl[i % BENCH_SAMPLES], &unpacked[i % BENCH_SAMPLES]);".format(name))
+            print("")
+            print("   bench_report(&{}_info, iterations, packed - start, bench_now() - packed);".format(name))
+            print("}\n")
+
+        print(bench_main % "".join("   bench_{}(iterations);\n".format(name) for name, group in self.groups))
 
     def enum_prefix(self, name):
         return 
@@ -675,6 +1539,15 @@ class Parser(object):
         print("    }")
         print("}\n")
 
+        print("static const struct agx_enum_value {}_values[] = {{".format(e_name))
+        for value in self.values:
+            print('   {{ "{}", {} }},'.format(value.name, value.value))
+        print("};\n")
+
+        print("static const struct agx_enum_info {}_info = {{".format(e_name))
+        print('   "{}", {}_values, ARRAY_SIZE({}_values),'.format(self.enum_human, e_name, e_name))
+        print("};\n")
+
     def parse(self, filename):
         file = open(filename, "rb")
         self.parser.ParseFile(file)
@@ -687,4 +1560,11 @@ if len(sys.argv) < 2:
 input_file = sys.argv[1]
 
 p = Parser()
-p.parse(input_file)
+
+# With --bench, emit the benchmark of the header instead of the header
+if "--bench" in sys.argv[2:]:
+    with contextlib.redirect_stdout(io.StringIO()):
+        p.parse(input_file)
+    p.emit_bench()
+else:
+    p.parse(input_file)
@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.h"
+#include "util.h"
+
+bool
+agx_index_open(struct agx_index *index, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct agx_index_header)) {
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	const struct agx_index_header *header = map;
+	size_t expected = sizeof(*header) +
+		header->type_count * sizeof(struct agx_index_type) +
+		header->frame_count * sizeof(struct agx_index_frame) +
+		header->packet_count * sizeof(struct agx_index_packet) +
+		header->field_count * sizeof(struct agx_index_type) +
+		header->address_count * sizeof(struct agx_index_address);
+
+	if (header->magic != AGX_INDEX_MAGIC || header->version != AGX_INDEX_VERSION ||
+	    expected != (size_t) st.st_size) {
+		fprintf(stderr, "index: bad header %08X version %u\n",
+				header->magic, header->version);
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	const uint8_t *p = (const uint8_t *) map + sizeof(*header);
+	index->map = map;
+	index->size = st.st_size;
+	index->header = header;
+	index->types = (const struct agx_index_type *) p;
+	p += header->type_count * sizeof(struct agx_index_type);
+	index->frames = (const struct agx_index_frame *) p;
+	p += header->frame_count * sizeof(struct agx_index_frame);
+	index->packets = (const struct agx_index_packet *) p;
+	p += header->packet_count * sizeof(struct agx_index_packet);
+	index->fields = (const struct agx_index_type *) p;
+	p += header->field_count * sizeof(struct agx_index_type);
+	index->addresses = (const struct agx_index_address *) p;
+	return true;
+}
+
+void
+agx_index_close(struct agx_index *index)
+{
+	munmap((void *) index->map, index->size);
+	index->map = NULL;
+}
+
+const char *
+agx_index_type_name(const struct agx_index *index, uint32_t id)
+{
+	for (unsigned i = 0; i < index->header->type_count; ++i) {
+		if (index->types[i].id == id)
+			return index->types[i].name;
+	}
+
+	return "UNKNOWN";
+}
+
+const char *
+agx_index_field_name(const struct agx_index *index, uint16_t id)
+{
+	return id < index->header->field_count ? index->fields[id].name : "?";
+}
+
+bool
+agx_index_type_id(const struct agx_index *index, const char *name, uint32_t *id)
+{
+	for (unsigned i = 0; i < index->header->type_count; ++i) {
+		if (!strcasecmp(index->types[i].name, name)) {
+			*id = index->types[i].id;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const struct agx_index_packet *
+agx_index_find_type(const struct agx_index *index, unsigned frame, uint32_t type,
+		    unsigned *count)
+{
+	const struct agx_index_frame *f = &index->frames[frame];
+	const struct agx_index_packet *packets = index->packets + f->first_packet;
+	unsigned lo = 0, hi = f->packet_count;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+
+		if (packets[mid].type < type)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	unsigned end = lo;
+
+	while (end < f->packet_count && packets[end].type == type)
+		++end;
+
+	*count = end - lo;
+	return packets + lo;
+}
+
+const struct agx_index_address *
+agx_index_find_addresses(const struct agx_index *index, uint64_t start,
+			 uint64_t end, uint64_t *count)
+{
+	const struct agx_index_address *addresses = index->addresses;
+	uint64_t lo = 0, hi = index->header->address_count;
+	uint64_t extent = index->header->address_extent;
+	uint64_t first = start > extent ? start - extent : 0;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (addresses[mid].address < first)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	uint64_t last = lo;
+	while (last < index->header->address_count && addresses[last].address < end)
+		++last;
+
+	*count = last - lo;
+	return addresses + lo;
+}
+
+/* Types are kept sorted by id, so the table does not depend on the order
+ * parallel decoding finds them in */
+
+void
+agx_index_add_type(struct agx_index_builder *b, uint32_t id, const char *name)
+{
+	unsigned pos = 0;
+
+	for (; pos < b->type_count && b->types[pos].id <= id; ++pos) {
+		if (b->types[pos].id == id)
+			return;
+	}
+
+	if (b->type_count == b->type_capacity) {
+		b->type_capacity = MAX2(b->type_capacity * 2, 16);
+		b->types = realloc(b->types, b->type_capacity * sizeof(*b->types));
+		assert(b->types != NULL);
+	}
+
+	memmove(&b->types[pos + 1], &b->types[pos],
+		(b->type_count - pos) * sizeof(*b->types));
+	b->type_count++;
+
+	struct agx_index_type *type = &b->types[pos];
+	memset(type, 0, sizeof(*type));
+	type->id = id;
+	snprintf(type->name, sizeof(type->name), "%s", name);
+}
+
+static int
+agx_index_compare_packets(const void *a, const void *b)
+{
+	const struct agx_index_packet *pa = a, *pb = b;
+
+	if (pa->type != pb->type)
+		return pa->type < pb->type ? -1 : 1;
+
+	return (pa->offset > pb->offset) - (pa->offset < pb->offset);
+}
+
+uint16_t
+agx_index_add_field(struct agx_index_builder *b, const char *name)
+{
+	for (unsigned i = 0; i < b->field_count; ++i) {
+		if (!strncmp(b->fields[i].name, name, sizeof(b->fields[i].name) - 1))
+			return i;
+	}
+
+	if (b->field_count == b->field_capacity) {
+		b->field_capacity = MAX2(b->field_capacity * 2, 16);
+		b->fields = realloc(b->fields, b->field_capacity * sizeof(*b->fields));
+		assert(b->fields != NULL);
+	}
+
+	struct agx_index_type *field = &b->fields[b->field_count];
+	memset(field, 0, sizeof(*field));
+	field->id = b->field_count;
+	snprintf(field->name, sizeof(field->name), "%s", name);
+	return b->field_count++;
+}
+
+/* Frames are added in output order, with packets in any order */
+
+void
+agx_index_add_frame(struct agx_index_builder *b, uint64_t output_size,
+		    uint64_t capture_offset,
+		    const struct agx_index_packet *packets, unsigned count,
+		    const struct agx_index_address *addresses,
+		    unsigned address_count)
+{
+	if (b->frame_count == b->frame_capacity) {
+		b->frame_capacity = MAX2(b->frame_capacity * 2, 256);
+		b->frames = realloc(b->frames, b->frame_capacity * sizeof(*b->frames));
+		assert(b->frames != NULL);
+	}
+
+	if (b->packet_count + count > b->packet_capacity) {
+		b->packet_capacity = MAX2(b->packet_capacity * 2, b->packet_count + count);
+		b->packets = realloc(b->packets, b->packet_capacity * sizeof(*b->packets));
+		assert(b->packets != NULL);
+	}
+
+	b->frames[b->frame_count++] = (struct agx_index_frame) {
+		.output_offset = b->output_size,
+		.output_size = output_size,
+		.capture_offset = capture_offset,
+		.first_packet = b->packet_count,
+		.packet_count = count,
+	};
+
+	struct agx_index_packet *dst = b->packets + b->packet_count;
+	memcpy(dst, packets, count * sizeof(*packets));
+	qsort(dst, count, sizeof(*dst), agx_index_compare_packets);
+
+	b->packet_count += count;
+	b->output_size += output_size;
+
+	if (b->address_count + address_count > b->address_capacity) {
+		b->address_capacity = MAX2(b->address_capacity * 2, b->address_count + address_count);
+		b->addresses = realloc(b->addresses, b->address_capacity * sizeof(*b->addresses));
+		assert(b->addresses != NULL);
+	}
+
+	for (unsigned i = 0; i < address_count; ++i) {
+		b->addresses[b->address_count] = addresses[i];
+		b->addresses[b->address_count++].frame = b->frame_count - 1;
+		b->address_extent = MAX2(b->address_extent, addresses[i].size);
+	}
+}
+
+static int
+agx_index_compare_fields(const void *a, const void *b)
+{
+	const struct agx_index_type *fa = a, *fb = b;
+	return strcmp(fa->name, fb->name);
+}
+
+static int
+agx_index_compare_addresses(const void *a, const void *b)
+{
+	const struct agx_index_address *pa = a, *pb = b;
+
+	if (pa->address != pb->address)
+		return pa->address < pb->address ? -1 : 1;
+
+	if (pa->frame != pb->frame)
+		return pa->frame < pb->frame ? -1 : 1;
+
+	return (pa->offset > pb->offset) - (pa->offset < pb->offset);
+}
+
+/* Renumbers fields by name and sorts addresses, so the index does not
+ * depend on the order workers found things in */
+
+static void
+agx_index_sort_addresses(struct agx_index_builder *b)
+{
+	uint16_t *remap = calloc(MAX2(b->field_count, 1), sizeof(*remap));
+	assert(remap != NULL);
+
+	qsort(b->fields, b->field_count, sizeof(*b->fields), agx_index_compare_fields);
+
+	for (unsigned i = 0; i < b->field_count; ++i) {
+		remap[b->fields[i].id] = i;
+		b->fields[i].id = i;
+	}
+
+	for (uint64_t i = 0; i < b->address_count; ++i)
+		b->addresses[i].field = remap[b->addresses[i].field];
+
+	qsort(b->addresses, b->address_count, sizeof(*b->addresses),
+	      agx_index_compare_addresses);
+	free(remap);
+}
+
+bool
+agx_index_write(struct agx_index_builder *b, const char *path)
+{
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+		return false;
+
+	agx_index_sort_addresses(b);
+
+	struct agx_index_header header = {
+		.magic = AGX_INDEX_MAGIC,
+		.version = AGX_INDEX_VERSION,
+		.type_count = b->type_count,
+		.frame_count = b->frame_count,
+		.packet_count = b->packet_count,
+		.output_size = b->output_size,
+		.field_count = b->field_count,
+		.address_extent = b->address_extent,
+		.address_count = b->address_count,
+	};
+
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok &= fwrite(b->types, sizeof(*b->types), b->type_count, fp) == b->type_count;
+	ok &= fwrite(b->frames, sizeof(*b->frames), b->frame_count, fp) == b->frame_count;
+	ok &= fwrite(b->packets, sizeof(*b->packets), b->packet_count, fp) == b->packet_count;
+	ok &= fwrite(b->fields, sizeof(*b->fields), b->field_count, fp) == b->field_count;
+	ok &= fwrite(b->addresses, sizeof(*b->addresses), b->address_count, fp) == b->address_count;
+	ok &= (fclose(fp) == 0);
+	return ok;
+}
+
+void
+agx_index_builder_fini(struct agx_index_builder *b)
+{
+	free(b->types);
+	free(b->frames);
+	free(b->packets);
+	free(b->fields);
+	free(b->addresses);
+	*b = (struct agx_index_builder) { 0 };
+}
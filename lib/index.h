@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_INDEX_H
+#define __AGX_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Index over the decoded output of a capture, written by decode-bin -i so
+ * tools can go straight to any frame or packet of a long session. The file
+ * is a header followed by fixed-size tables of packet type names, frames and
+ * packets, so a reader maps it and indexes the tables directly.
+ *
+ * Each frame gives the byte range of its output and the offset of its SUBMIT
+ * record in the (uncompressed) capture. Its packets are contiguous in the
+ * packet table, grouped by type and in output order within a type, each with
+ * its offset from the start of the frame's output. Output compressed with
+ * decode-bin -z has full blocks of AGX_LZ_BLOCK_SIZE, so the block holding
+ * an offset is known without decompressing anything before it.
+ *
+ * Then every nonzero address field of those packets (Buffer, Code and so
+ * on, named in a table like the types) is listed sorted by the address it
+ * holds, with the number of bytes it references where the decoder knows it:
+ * uniform buffers, shaders and records. Other fields have a size of zero and
+ * only cover the address itself. The header gives the largest size, so the
+ * fields overlapping a range are found by binary search from that far below
+ * its start. */
+
+#define AGX_INDEX_MAGIC (0x49584741) /* "AGXI" */
+#define AGX_INDEX_VERSION (3)
+#define AGX_INDEX_NAME_LENGTH (32)
+
+struct agx_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type_count;
+	uint32_t frame_count;
+	uint64_t packet_count;
+	uint64_t output_size;
+	uint32_t field_count;
+	uint32_t address_extent;
+	uint64_t address_count;
+} __attribute__((packed));
+
+struct agx_index_type {
+	uint32_t id;
+	char name[AGX_INDEX_NAME_LENGTH];
+} __attribute__((packed));
+
+struct agx_index_frame {
+	uint64_t output_offset;
+	uint64_t output_size;
+	uint64_t capture_offset;
+	uint64_t first_packet;
+	uint32_t packet_count;
+	uint32_t padding;
+} __attribute__((packed));
+
+struct agx_index_packet {
+	uint64_t va;
+	uint32_t type;
+	uint32_t offset;
+} __attribute__((packed));
+
+struct agx_index_address {
+	uint64_t address;
+	uint32_t size;
+	uint32_t padding;
+	uint32_t frame;
+	uint32_t offset;
+	uint32_t type;
+	uint16_t field;
+	uint16_t encoder;
+} __attribute__((packed));
+
+struct agx_index {
+	const uint8_t *map;
+	size_t size;
+
+	const struct agx_index_header *header;
+	const struct agx_index_type *types;
+	const struct agx_index_frame *frames;
+	const struct agx_index_packet *packets;
+	const struct agx_index_type *fields;
+	const struct agx_index_address *addresses;
+};
+
+bool agx_index_open(struct agx_index *index, const char *path);
+void agx_index_close(struct agx_index *index);
+
+const char *agx_index_type_name(const struct agx_index *index, uint32_t id);
+bool agx_index_type_id(const struct agx_index *index, const char *name, uint32_t *id);
+const char *agx_index_field_name(const struct agx_index *index, uint16_t id);
+
+/* Packets of one type in a frame, found by binary search */
+const struct agx_index_packet *
+agx_index_find_type(const struct agx_index *index, unsigned frame, uint32_t type,
+		    unsigned *count);
+
+/* Address fields that may reference bytes in [start, end), by binary search.
+ * Some of them may end before start, so check each with
+ * agx_index_address_overlaps. */
+const struct agx_index_address *
+agx_index_find_addresses(const struct agx_index *index, uint64_t start,
+			 uint64_t end, uint64_t *count);
+
+static inline bool
+agx_index_address_overlaps(const struct agx_index_address *a, uint64_t start,
+			   uint64_t end)
+{
+	return a->address < end && a->address + (a->size ? a->size : 1) > start;
+}
+
+/* Accumulates an index while decoding, then writes it out */
+
+struct agx_index_builder {
+	struct agx_index_type *types;
+	unsigned type_count, type_capacity;
+
+	struct agx_index_frame *frames;
+	unsigned frame_count, frame_capacity;
+
+	struct agx_index_packet *packets;
+	uint64_t packet_count, packet_capacity;
+
+	/* Fields are numbered in the order they are added, and renumbered in
+	 * name order when written */
+	struct agx_index_type *fields;
+	unsigned field_count, field_capacity;
+
+	struct agx_index_address *addresses;
+	uint64_t address_count, address_capacity;
+	uint32_t address_extent;
+
+	uint64_t output_size;
+};
+
+void agx_index_add_type(struct agx_index_builder *b, uint32_t id, const char *name);
+uint16_t agx_index_add_field(struct agx_index_builder *b, const char *name);
+
+/* The frame of each address is filled in */
+void agx_index_add_frame(struct agx_index_builder *b, uint64_t output_size,
+			 uint64_t capture_offset,
+			 const struct agx_index_packet *packets, unsigned count,
+			 const struct agx_index_address *addresses,
+			 unsigned address_count);
+
+bool agx_index_write(struct agx_index_builder *b, const char *path);
+void agx_index_builder_fini(struct agx_index_builder *b);
+
+#endif
@@ -27,41 +27,7 @@
 #include <stdbool.h>
 #include <mach/mach.h>
 #include "selectors.h"
-
-enum agx_alloc_type {
-	AGX_ALLOC_REGULAR = 0,
-	AGX_ALLOC_MEMMAP = 1,
-	AGX_ALLOC_CMDBUF = 2,
-	AGX_NUM_ALLOC,
-};
-
-static const char *agx_alloc_types[AGX_NUM_ALLOC] = { "mem", "map", "cmd" };
-
-struct agx_allocation {
-	enum agx_alloc_type type;
-	size_t size;
-
-	/* Index unique only up to type, process-local */
-	unsigned index;
-
-	/* Globally unique value (system wide) for tracing. Exists for
-	 * resources, command buffers, GPU submissions, segments, segent lists,
-	 * encoders, accelerators, and channels. Corresponds to Instruments'
-	 * magic table metal-gpu-submission-to-command-buffer-id */
-	uint64_t guid;
-
-	/* If CPU mapped, CPU address. NULL if not mapped */
-	void *map;
-
-	/* If type REGULAR, mapped GPU address */
-	uint64_t gpu_va;
-
-	/* Human-readable label, or NULL if none */
-	char *name;
-
-	/* Used while decoding, marked read-only */
-	bool ro;
-};
+#include "alloc.h"
 
 struct agx_notification_queue {
 	mach_port_t port;
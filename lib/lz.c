@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "lz.h"
+#include "util.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+/* Each sequence is a token byte holding the literal count and match length
+ * minus LZ_MIN_MATCH in its high and low nibbles, extended by bytes of 255
+ * then a final smaller byte when a nibble is 15. The literals follow, then
+ * a 16-bit little endian match offset and the match length extension. The
+ * last sequence of a block is literals alone. */
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *
+lz_put_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*(op++) = 255;
+
+	*(op++) = len;
+	return op;
+}
+
+static uint8_t *
+lz_put_sequence(uint8_t *op, const uint8_t *literals, size_t literal_count,
+		size_t offset, size_t match_length)
+{
+	size_t extra = match_length ? match_length - LZ_MIN_MATCH : 0;
+	uint8_t *token = op++;
+
+	*token = (MIN2(literal_count, 15) << 4) | MIN2(extra, 15);
+
+	if (literal_count >= 15)
+		op = lz_put_length(op, literal_count - 15);
+
+	memcpy(op, literals, literal_count);
+	op += literal_count;
+
+	if (!match_length)
+		return op;
+
+	*(op++) = offset & 0xFF;
+	*(op++) = offset >> 8;
+
+	if (extra >= 15)
+		op = lz_put_length(op, extra - 15);
+
+	return op;
+}
+
+/* Greedy compression with a single-entry hash table, skipping ahead faster
+ * the longer it goes without a match so incompressible data stays cheap.
+ * dst must hold AGX_LZ_BOUND(size) bytes, and size must fit in 32 bits. */
+
+size_t
+agx_lz_compress(const uint8_t *src, size_t size, uint8_t *dst)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = { 0 };
+	const uint8_t *ip = src, *anchor = src, *end = src + size;
+	uint8_t *op = dst;
+
+	while (size >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+		uint32_t v = lz_read32(ip);
+		unsigned h = lz_hash(v);
+		const uint8_t *ref = src + table[h];
+
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != v) {
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		size_t length = LZ_MIN_MATCH;
+
+		while (ip + length + 8 <= end) {
+			uint64_t a, b;
+			memcpy(&a, ip + length, 8);
+			memcpy(&b, ref + length, 8);
+
+			if (a != b)
+				break;
+
+			length += 8;
+		}
+
+		while (ip + length < end && ip[length] == ref[length])
+			++length;
+
+		op = lz_put_sequence(op, anchor, ip - anchor, ip - ref, length);
+		ip += length;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(op, anchor, end - anchor, 0, 0);
+	return op - dst;
+}
+
+static bool
+lz_get_length(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= end)
+			return false;
+
+		b = *((*ip)++);
+		*length += b;
+	} while (b == 255);
+
+	return true;
+}
+
+/* Fails on malformed input rather than reading or writing out of bounds */
+
+bool
+agx_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size)
+{
+	const uint8_t *ip = src, *iend = src + size;
+	uint8_t *op = dst, *oend = dst + raw_size;
+
+	while (ip < iend) {
+		unsigned token = *(ip++);
+		size_t literal_count = token >> 4;
+
+		if (literal_count == 15 && !lz_get_length(&ip, iend, &literal_count))
+			return false;
+
+		if (literal_count > (size_t) (iend - ip) || literal_count > (size_t) (oend - op))
+			return false;
+
+		memcpy(op, ip, literal_count);
+		op += literal_count;
+		ip += literal_count;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		size_t length = token & 0xF;
+		ip += 2;
+
+		if (length == 15 && !lz_get_length(&ip, iend, &length))
+			return false;
+
+		length += LZ_MIN_MATCH;
+
+		if (!offset || offset > (size_t) (op - dst) || length > (size_t) (oend - op))
+			return false;
+
+		const uint8_t *ref = op - offset;
+
+		if (offset >= length) {
+			memcpy(op, ref, length);
+		} else {
+			for (size_t i = 0; i < length; ++i)
+				op[i] = ref[i];
+		}
+
+		op += length;
+	}
+
+	return op == oend;
+}
+
+bool
+agx_lz_is_stream(const void *data, size_t size)
+{
+	const struct agx_lz_header *header = data;
+
+	return size >= sizeof(*header) && header->magic == AGX_LZ_MAGIC &&
+	       header->version == AGX_LZ_VERSION;
+}
+
+/* Walks the block headers of a stream, decompressing each complete block into
+ * dst if given. A truncated final block (if the writer crashed) ends the
+ * stream. */
+
+static size_t
+lz_walk(const uint8_t *data, size_t size, uint8_t *dst, size_t raw_size)
+{
+	size_t offset = sizeof(struct agx_lz_header);
+	size_t total = 0;
+
+	while (offset + sizeof(struct agx_lz_block) <= size) {
+		struct agx_lz_block block;
+		memcpy(&block, data + offset, sizeof(block));
+		offset += sizeof(block);
+
+		if (block.packed_size > size - offset || block.packed_size > block.raw_size)
+			break;
+
+		if (dst) {
+			if (block.raw_size > raw_size - total)
+				break;
+
+			const uint8_t *packed = data + offset;
+			bool ok = true;
+
+			if (block.packed_size == block.raw_size)
+				memcpy(dst + total, packed, block.raw_size);
+			else
+				ok = agx_lz_decompress(packed, block.packed_size, dst + total, block.raw_size);
+
+			if (!ok) {
+				fprintf(stderr, "lz: corrupt block at offset %zu\n",
+					offset - sizeof(block));
+				break;
+			}
+		}
+
+		offset += block.packed_size;
+		total += block.raw_size;
+	}
+
+	return total;
+}
+
+/* Decompressed size of a whole stream */
+
+size_t
+agx_lz_stream_size(const uint8_t *data, size_t size)
+{
+	return lz_walk(data, size, NULL, 0);
+}
+
+/* Decompresses a whole stream, returning the number of bytes written */
+
+size_t
+agx_lz_stream_decompress(const uint8_t *data, size_t size, uint8_t *dst, size_t raw_size)
+{
+	return lz_walk(data, size, dst, raw_size);
+}
+
+/* Writer side. Whole blocks are queued for a worker thread, which compresses
+ * and writes them in order while the caller carries on decoding. The queue is
+ * short, so a writer that falls behind stalls the caller rather than letting
+ * memory grow. */
+
+#define LZ_QUEUE_SIZE 4
+
+struct lz_job {
+	uint8_t *data;
+	size_t size;
+};
+
+struct lz_writer {
+	FILE *fp;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct lz_job queue[LZ_QUEUE_SIZE];
+	unsigned head, count;
+	bool done, failed;
+
+	/* Block being filled by the caller */
+	uint8_t *fill;
+	size_t fill_size;
+};
+
+static void
+lz_write_block(struct lz_writer *w, const uint8_t *data, size_t size, uint8_t *packed)
+{
+	struct agx_lz_block block = {
+		.raw_size = size,
+		.packed_size = agx_lz_compress(data, size, packed),
+	};
+
+	/* Store incompressible blocks as is */
+	if (block.packed_size >= block.raw_size) {
+		block.packed_size = block.raw_size;
+		packed = (uint8_t *) data;
+	}
+
+	bool ok = fwrite(&block, sizeof(block), 1, w->fp) == 1;
+	ok &= fwrite(packed, 1, block.packed_size, w->fp) == block.packed_size;
+
+	if (!ok && !w->failed) {
+		fprintf(stderr, "lz: failed to write compressed output\n");
+		w->failed = true;
+	}
+}
+
+static void *
+lz_worker(void *data)
+{
+	struct lz_writer *w = data;
+	uint8_t *packed = malloc(AGX_LZ_BOUND(AGX_LZ_BLOCK_SIZE));
+	assert(packed != NULL);
+
+	pthread_mutex_lock(&w->lock);
+
+	for (;;) {
+		while (!w->count && !w->done)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (!w->count)
+			break;
+
+		/* The job stays queued until written, so its slot isn't reused */
+		struct lz_job job = w->queue[w->head];
+		pthread_mutex_unlock(&w->lock);
+
+		lz_write_block(w, job.data, job.size, packed);
+		free(job.data);
+
+		pthread_mutex_lock(&w->lock);
+		w->head = (w->head + 1) % LZ_QUEUE_SIZE;
+		w->count--;
+		pthread_cond_broadcast(&w->cond);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	free(packed);
+	return NULL;
+}
+
+static void
+lz_submit(struct lz_writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+
+	while (w->count == LZ_QUEUE_SIZE)
+		pthread_cond_wait(&w->cond, &w->lock);
+
+	w->queue[(w->head + w->count) % LZ_QUEUE_SIZE] = (struct lz_job) {
+		.data = w->fill,
+		.size = w->fill_size,
+	};
+
+	w->count++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	w->fill = malloc(AGX_LZ_BLOCK_SIZE);
+	w->fill_size = 0;
+	assert(w->fill != NULL);
+}
+
+#ifdef __APPLE__
+static int
+lz_write(void *cookie, const char *buf, int size)
+#else
+static ssize_t
+lz_write(void *cookie, const char *buf, size_t size)
+#endif
+{
+	struct lz_writer *w = cookie;
+
+	for (size_t done = 0; done < (size_t) size; ) {
+		size_t n = MIN2((size_t) size - done, AGX_LZ_BLOCK_SIZE - w->fill_size);
+
+		memcpy(w->fill + w->fill_size, buf + done, n);
+		w->fill_size += n;
+		done += n;
+
+		if (w->fill_size == AGX_LZ_BLOCK_SIZE)
+			lz_submit(w);
+	}
+
+	return size;
+}
+
+static int
+lz_close(void *cookie)
+{
+	struct lz_writer *w = cookie;
+
+	if (w->fill_size)
+		lz_submit(w);
+
+	free(w->fill);
+
+	pthread_mutex_lock(&w->lock);
+	w->done = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+
+	int ret = fclose(w->fp);
+	ret |= w->failed ? EOF : 0;
+	free(w);
+	return ret;
+}
+
+FILE *
+agx_lz_fopen(FILE *fp)
+{
+	if (!fp)
+		return NULL;
+
+	struct agx_lz_header header = {
+		.magic = AGX_LZ_MAGIC,
+		.version = AGX_LZ_VERSION,
+	};
+
+	fwrite(&header, sizeof(header), 1, fp);
+
+	struct lz_writer *w = calloc(1, sizeof(*w));
+	assert(w != NULL);
+
+	w->fp = fp;
+	w->fill = malloc(AGX_LZ_BLOCK_SIZE);
+	assert(w->fill != NULL);
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	pthread_create(&w->thread, NULL, lz_worker, w);
+
+#ifdef __APPLE__
+	return funopen(w, NULL, lz_write, NULL, lz_close);
+#else
+	return fopencookie(w, "w", (cookie_io_functions_t) {
+		.write = lz_write,
+		.close = lz_close,
+	});
+#endif
+}
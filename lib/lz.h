@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_LZ_H
+#define __AGX_LZ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Compressed streams for dumps and captures, which are highly redundant and
+ * otherwise limited by disk bandwidth. A stream is a header followed by
+ * blocks, each a block header and the block's bytes compressed with a small
+ * LZ77 codec in the style of LZ4. Matches never reach outside their block,
+ * so any block can be decompressed alone, and a reader can seek by hopping
+ * from block header to block header. A block whose bytes did not compress
+ * is stored as is, with packed_size equal to raw_size. */
+
+#define AGX_LZ_MAGIC (0x5A584741) /* "AGXZ" */
+#define AGX_LZ_VERSION (1)
+#define AGX_LZ_BLOCK_SIZE (1 << 20)
+
+struct agx_lz_header {
+	uint32_t magic;
+	uint32_t version;
+} __attribute__((packed));
+
+struct agx_lz_block {
+	uint32_t raw_size;
+	uint32_t packed_size;
+} __attribute__((packed));
+
+/* Worst case compressed size of n bytes */
+#define AGX_LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+size_t agx_lz_compress(const uint8_t *src, size_t size, uint8_t *dst);
+bool agx_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size);
+
+bool agx_lz_is_stream(const void *data, size_t size);
+size_t agx_lz_stream_size(const uint8_t *data, size_t size);
+size_t agx_lz_stream_decompress(const uint8_t *data, size_t size, uint8_t *dst, size_t raw_size);
+
+/* Opens a FILE that compresses everything written to it into fp, on a
+ * background thread. Closing it writes out the last block and closes fp. */
+FILE *agx_lz_fopen(FILE *fp);
+
+#endif
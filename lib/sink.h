@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_SINK_H
+#define __AGX_SINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <math.h>
+
+/* Buffered text output for the decoder. Formatting every field with fprintf
+ * dominates decode time (format parsing and stdio locking per call), so
+ * instead text is appended to a large private buffer with hand-rolled
+ * number formatting, and written to the backing FILE in big chunks. Output
+ * is byte-for-byte what the equivalent printf formats would produce.
+ *
+ * Anything else writing to the same FILE must call agx_sink_flush first to
+ * keep the output ordered.
+ *
+ * A memory sink has no FILE and grows instead of flushing, for capturing
+ * output to replay later. */
+
+#define AGX_SINK_SIZE (1 << 20)
+
+struct agx_sink {
+	FILE *fp;
+	char *buf;
+	size_t len, cap;
+	bool memory;
+
+	/* buf belongs to the caller, see agx_sink_init_buffer */
+	bool borrowed;
+
+	/* Bytes flushed so far, so writers can tell where they are */
+	uint64_t flushed;
+};
+
+static inline void
+agx_sink_init(struct agx_sink *s, FILE *fp)
+{
+	s->fp = fp;
+	s->len = 0;
+	s->cap = AGX_SINK_SIZE;
+	s->memory = false;
+	s->borrowed = false;
+	s->flushed = 0;
+	s->buf = malloc(s->cap);
+	assert(s->buf != NULL);
+}
+
+/* A sink writing through a caller's buffer, typically on the stack, for
+ * short-lived sinks where allocating AGX_SINK_SIZE per use would cost more
+ * than the output */
+static inline void
+agx_sink_init_buffer(struct agx_sink *s, FILE *fp, char *buf, size_t size)
+{
+	s->fp = fp;
+	s->len = 0;
+	s->cap = size;
+	s->memory = false;
+	s->borrowed = true;
+	s->flushed = 0;
+	s->buf = buf;
+}
+
+static inline void
+agx_sink_init_memory(struct agx_sink *s)
+{
+	s->fp = NULL;
+	s->len = 0;
+	s->cap = 4096;
+	s->memory = true;
+	s->borrowed = false;
+	s->flushed = 0;
+	s->buf = malloc(s->cap);
+	assert(s->buf != NULL);
+}
+
+static inline void
+agx_sink_flush(struct agx_sink *s)
+{
+	if (s->memory)
+		return;
+
+	if (s->len && s->fp)
+		fwrite(s->buf, 1, s->len, s->fp);
+
+	s->flushed += s->len;
+	s->len = 0;
+}
+
+/* Offset of the next byte written, counting from when the sink was created */
+static inline uint64_t
+agx_sink_position(const struct agx_sink *s)
+{
+	return s->flushed + s->len;
+}
+
+static inline void
+agx_sink_fini(struct agx_sink *s)
+{
+	agx_sink_flush(s);
+
+	if (!s->borrowed)
+		free(s->buf);
+
+	s->buf = NULL;
+}
+
+/* Make room for n bytes, returning where to write them */
+
+static inline char *
+agx_sink_reserve(struct agx_sink *s, size_t n)
+{
+	if (__builtin_expect(s->len + n > s->cap, 0)) {
+		if (s->memory) {
+			s->cap = (s->len + n > s->cap * 2) ? s->len + n : s->cap * 2;
+			s->buf = realloc(s->buf, s->cap);
+			assert(s->buf != NULL);
+			return s->buf + s->len;
+		}
+
+		agx_sink_flush(s);
+
+		if (n > s->cap) {
+			s->cap = n;
+			s->buf = realloc(s->borrowed ? NULL : s->buf, s->cap);
+			s->borrowed = false;
+			assert(s->buf != NULL);
+		}
+	}
+
+	return s->buf + s->len;
+}
+
+static inline void
+agx_sink_write(struct agx_sink *s, const void *data, size_t n)
+{
+	memcpy(agx_sink_reserve(s, n), data, n);
+	s->len += n;
+}
+
+/* String literals, with the length known at compile time */
+#define agx_sink_lit(s, str) agx_sink_write(s, str, sizeof(str) - 1)
+
+static inline void
+agx_sink_puts(struct agx_sink *s, const char *str)
+{
+	agx_sink_write(s, str, strlen(str));
+}
+
+static inline void
+agx_sink_putc(struct agx_sink *s, char c)
+{
+	*agx_sink_reserve(s, 1) = c;
+	s->len++;
+}
+
+/* Equivalent to printf("%*s", n, "") */
+
+static inline void
+agx_sink_indent(struct agx_sink *s, unsigned n)
+{
+	memset(agx_sink_reserve(s, n), ' ', n);
+	s->len += n;
+}
+
+/* printf("%" PRIu64) */
+
+static inline void
+agx_sink_u64(struct agx_sink *s, uint64_t v)
+{
+	static const char pairs[201] =
+		"00010203040506070809101112131415161718192021222324"
+		"25262728293031323334353637383940414243444546474849"
+		"50515253545556575859606162636465666768697071727374"
+		"75767778798081828384858687888990919293949596979899";
+
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+
+	while (v >= 100) {
+		unsigned i = (v % 100) * 2;
+		v /= 100;
+		*(--p) = pairs[i + 1];
+		*(--p) = pairs[i];
+	}
+
+	if (v >= 10) {
+		*(--p) = pairs[v * 2 + 1];
+		*(--p) = pairs[v * 2];
+	} else {
+		*(--p) = '0' + v;
+	}
+
+	agx_sink_write(s, p, (tmp + sizeof(tmp)) - p);
+}
+
+/* printf("%" PRId64) */
+
+static inline void
+agx_sink_i64(struct agx_sink *s, int64_t v)
+{
+	if (v < 0) {
+		agx_sink_putc(s, '-');
+		agx_sink_u64(s, -(uint64_t) v);
+	} else {
+		agx_sink_u64(s, v);
+	}
+}
+
+/* printf("%" PRIx64) or, if upper, printf("%" PRIX64), padded with zeroes to
+ * at least min_digits like "%0*" PRIx64 */
+
+static inline void
+agx_sink_hex(struct agx_sink *s, uint64_t v, unsigned min_digits, bool upper)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char tmp[16];
+	unsigned n = 0;
+
+	do {
+		tmp[15 - n++] = digits[v & 0xF];
+		v >>= 4;
+	} while (v);
+
+	while (n < min_digits && n < 16)
+		tmp[15 - n++] = '0';
+
+	agx_sink_write(s, tmp + 16 - n, n);
+}
+
+/* Escape hatch for anything rare or awkward enough not to hand-roll */
+
+static inline void __attribute__((format(printf, 2, 3)))
+agx_sink_printf(struct agx_sink *s, const char *format, ...)
+{
+	va_list args;
+	size_t room = 256;
+
+	for (;;) {
+		char *out = agx_sink_reserve(s, room);
+
+		va_start(args, format);
+		int n = vsnprintf(out, room, format, args);
+		va_end(args);
+
+		assert(n >= 0);
+
+		if ((size_t) n < room) {
+			s->len += n;
+			return;
+		}
+
+		room = n + 1;
+	}
+}
+
+/* printf("%f") of a float. Widened to double, a float times 10^6 is exact
+ * (24 + 20 significant bits), so rounding it to an integer rounds exactly
+ * the way printf does, ties to even. Huge and non-finite values go through
+ * printf itself. */
+
+static inline void
+agx_sink_float(struct agx_sink *s, float f)
+{
+	double v = f;
+
+	if (!isfinite(v) || fabs(v) >= 9007199254740992.0 /* 2^53 */) {
+		agx_sink_printf(s, "%f", v);
+		return;
+	}
+
+	if (signbit(v)) {
+		agx_sink_putc(s, '-');
+		v = -v;
+	}
+
+	double ip = floor(v);
+	double frac = nearbyint((v - ip) * 1000000.0);
+
+	if (frac >= 1000000.0) {
+		ip += 1.0;
+		frac -= 1000000.0;
+	}
+
+	agx_sink_u64(s, (uint64_t) ip);
+	agx_sink_putc(s, '.');
+
+	char tmp[6];
+	uint32_t digits = (uint32_t) frac;
+
+	for (int i = 5; i >= 0; --i) {
+		tmp[i] = '0' + (digits % 10);
+		digits /= 10;
+	}
+
+	agx_sink_write(s, tmp, 6);
+}
+
+#endif
@@ -25,11 +25,14 @@
 #define __UTIL_H
 
 #include <string.h>
+#include "sink.h"
 
 #define UNUSED __attribute__((unused))
 #define MAX2(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN2(x, y) (((x) < (y)) ? (x) : (y))
 #define ALIGN_POT(v, pot) (((v) + ((pot) - 1)) & ~((pot) - 1))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
 static uint32_t
 fui(float f)
@@ -47,50 +50,112 @@ uif(uint32_t u)
 	return f;
 }
 
-/* Pretty-printer */
-static void
-hexdump(FILE *fp, const uint8_t *hex, size_t cnt, bool with_strings)
+/* 64-bit content hash for caching decoded data, not cryptographic */
+
+static inline uint64_t
+agx_hash(const void *data, size_t size, uint64_t seed)
 {
-	unsigned zero_count = 0;
+	const uint8_t *p = data;
+	uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ull);
 
-	for (unsigned i = 0; i < cnt; ++i) {
-		if ((i & 0xF) == 0)
-			fprintf(fp, "%06X  ", i);
+	for (; size >= 8; size -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ (w * 0xBF58476D1CE4E5B9ull)) * 0x94D049BB133111EBull;
+		h ^= h >> 31;
+	}
 
-		uint8_t v = hex[i];
+	for (; size; --size, ++p)
+		h = (h ^ *p) * 0x100000001B3ull;
 
-		if (v == 0 && (i & 0xF) == 0) {
-			/* Check if we're starting an aligned run of zeroes */
-			unsigned zero_count = 0;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	return h;
+}
 
-			for (unsigned j = i; j < cnt; ++j) {
-				if (hex[j] == 0)
-					zero_count++;
-				else
-					break;
-			}
+/* Length of the run of zero bytes at the start of data, checking 16 bytes at
+ * a time until the run ends */
+static inline size_t
+hexdump_zero_run(const uint8_t *data, size_t cnt)
+{
+	size_t n = 0;
+
+	for (; n + 16 <= cnt; n += 16) {
+		uint64_t w[2];
+		memcpy(w, data + n, sizeof(w));
+
+		if (w[0] | w[1])
+			break;
+	}
+
+	while (n < cnt && !data[n])
+		++n;
+
+	return n;
+}
+
+/* Pretty-printer. Lines are formatted straight into the sink, and aligned runs
+ * of at least 32 zero bytes are elided with a single '*' line. */
+static void
+hexdump_sink(struct agx_sink *out, const uint8_t *hex, size_t cnt, bool with_strings)
+{
+	static const char digits[] = "0123456789ABCDEF";
+
+	for (size_t i = 0; i < cnt; ) {
+		agx_sink_hex(out, i, 6, true);
+		agx_sink_lit(out, "  ");
+
+		if (hex[i] == 0) {
+			size_t zero_count = hexdump_zero_run(hex + i, cnt - i);
 
 			if (zero_count >= 32) {
-				fprintf(fp, "*\n");
-				i += (zero_count & ~0xF) - 1;
+				agx_sink_lit(out, "*\n");
+				i += zero_count & ~0xF;
 				continue;
 			}
 		}
 
-		fprintf(fp, "%02X ", hex[i]);
-		if ((i & 0xF) == 0xF && with_strings) {
-			fprintf(fp, " | ");
-			for (unsigned j = i & ~0xF; j <= i; ++j) {
-				uint8_t c = hex[j];
-				fputc((c < 32 || c > 128) ? '.' : c, fp);
+		size_t n = MIN2(cnt - i, 16);
+		char *line = agx_sink_reserve(out, 16 * 3 + 3 + 16 + 1);
+		char *p = line;
+
+		for (unsigned j = 0; j < n; ++j) {
+			p[0] = digits[hex[i + j] >> 4];
+			p[1] = digits[hex[i + j] & 0xF];
+			p[2] = ' ';
+			p += 3;
+		}
+
+		if (n == 16) {
+			if (with_strings) {
+				memcpy(p, " | ", 3);
+				p += 3;
+
+				for (unsigned j = 0; j < 16; ++j) {
+					uint8_t c = hex[i + j];
+					*(p++) = (c < 32 || c > 128) ? '.' : c;
+				}
 			}
+
+			*(p++) = '\n';
 		}
 
-		if ((i & 0xF) == 0xF)
-			fprintf(fp, "\n");
+		out->len += p - line;
+		i += n;
 	}
 
-	fprintf(fp, "\n");
+	agx_sink_putc(out, '\n');
+}
+
+static void
+hexdump(FILE *fp, const uint8_t *hex, size_t cnt, bool with_strings)
+{
+	char buf[4096];
+	struct agx_sink out;
+	agx_sink_init_buffer(&out, fp, buf, sizeof(buf));
+	hexdump_sink(&out, hex, cnt, with_strings);
+	agx_sink_fini(&out);
 }
 
 #endif
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include "lz.h"
+
+/* Compresses stdin to stdout, or with -d decompresses a file, optionally
+ * starting from a given block without touching the ones before it */
+
+static void
+compress(void)
+{
+	FILE *out = agx_lz_fopen(stdout);
+	char buf[65536];
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), stdin)))
+		fwrite(buf, 1, n, out);
+
+	if (fclose(out))
+		errx(2, "write failed");
+}
+
+static void
+decompress(const char *path, unsigned first)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		err(2, "input file");
+
+	struct agx_lz_header header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    !agx_lz_is_stream(&header, sizeof(header)))
+		errx(2, "not a compressed stream");
+
+	uint8_t *packed = malloc(AGX_LZ_BOUND(AGX_LZ_BLOCK_SIZE));
+	uint8_t *raw = malloc(AGX_LZ_BLOCK_SIZE);
+	struct agx_lz_block block;
+
+	for (unsigned i = 0; fread(&block, sizeof(block), 1, fp) == 1; ++i) {
+		if (block.raw_size > AGX_LZ_BLOCK_SIZE || block.packed_size > block.raw_size)
+			errx(2, "corrupt block %u", i);
+
+		/* Seek over blocks before the first wanted */
+		if (i < first) {
+			fseeko(fp, block.packed_size, SEEK_CUR);
+			continue;
+		}
+
+		if (fread(packed, 1, block.packed_size, fp) != block.packed_size)
+			break;
+
+		if (block.packed_size == block.raw_size)
+			memcpy(raw, packed, block.raw_size);
+		else if (!agx_lz_decompress(packed, block.packed_size, raw, block.raw_size))
+			errx(2, "corrupt block %u", i);
+
+		fwrite(raw, 1, block.raw_size, stdout);
+	}
+
+	free(packed);
+	free(raw);
+	fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+	bool extract = false;
+	unsigned first = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "db:")) != -1) {
+		switch (c) {
+		case 'd':
+			extract = true;
+			break;
+		case 'b':
+			first = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			errx(1, "usage: lz-bin < IN > OUT, or lz-bin -d [-b block] IN > OUT");
+		}
+	}
+
+	if (extract && optind == argc - 1)
+		decompress(argv[optind], first);
+	else if (!extract && optind == argc)
+		compress();
+	else
+		errx(1, "usage: lz-bin < IN > OUT, or lz-bin -d [-b block] IN > OUT");
+
+	return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.h"
+#include "lz.h"
+
+/* Looks up frames and packets of decoded output through an index written by
+ * decode-bin -i, reading only the bytes asked for. Output compressed with
+ * decode-bin -z is read by hopping block headers to the blocks needed. */
+
+struct output {
+	const uint8_t *map;
+	size_t size;
+	bool packed;
+
+	/* Last block decompressed, kept for reads within the same block */
+	uint8_t *raw;
+	int64_t block;
+	uint32_t raw_size;
+};
+
+static const uint8_t *
+map_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(2, "%s", path);
+
+	struct stat st;
+	if (fstat(fd, &st))
+		err(2, "%s", path);
+
+	*size = st.st_size;
+	void *map = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+
+	if (map == MAP_FAILED)
+		err(2, "%s", path);
+
+	return map;
+}
+
+/* Decompresses the block holding a given offset, every block but the last
+ * being full */
+static void
+output_block(struct output *out, uint64_t block)
+{
+	if (out->block == (int64_t) block)
+		return;
+
+	size_t offs = sizeof(struct agx_lz_header);
+
+	for (uint64_t i = 0; ; ++i) {
+		struct agx_lz_block hdr;
+		if (offs + sizeof(hdr) > out->size)
+			errx(3, "offset past end of output");
+
+		memcpy(&hdr, out->map + offs, sizeof(hdr));
+		offs += sizeof(hdr);
+
+		if (hdr.raw_size > AGX_LZ_BLOCK_SIZE || hdr.packed_size > hdr.raw_size ||
+		    offs + hdr.packed_size > out->size)
+			errx(3, "corrupt block %llu", (unsigned long long) i);
+
+		if (i < block) {
+			offs += hdr.packed_size;
+			continue;
+		}
+
+		if (hdr.packed_size == hdr.raw_size)
+			memcpy(out->raw, out->map + offs, hdr.raw_size);
+		else if (!agx_lz_decompress(out->map + offs, hdr.packed_size, out->raw, hdr.raw_size))
+			errx(3, "corrupt block %llu", (unsigned long long) i);
+
+		out->block = block;
+		out->raw_size = hdr.raw_size;
+		return;
+	}
+}
+
+static void
+output_write(struct output *out, uint64_t offset, uint64_t size, FILE *fp)
+{
+	if (!out->packed) {
+		if (offset + size > out->size)
+			errx(3, "offset past end of output");
+
+		fwrite(out->map + offset, 1, size, fp);
+		return;
+	}
+
+	while (size) {
+		output_block(out, offset / AGX_LZ_BLOCK_SIZE);
+
+		uint32_t start = offset % AGX_LZ_BLOCK_SIZE;
+		if (start >= out->raw_size)
+			errx(3, "offset past end of output");
+
+		uint64_t n = out->raw_size - start;
+		if (n > size)
+			n = size;
+
+		fwrite(out->raw + start, 1, n, fp);
+		offset += n;
+		size -= n;
+	}
+}
+
+static int
+cmp_offset(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Sorted offsets of every packet in a frame, to find where each one ends. A
+ * packet's output runs until the next packet of any type in the frame. */
+
+struct frame_offsets {
+	int64_t frame;
+	uint32_t *offsets;
+	unsigned count;
+};
+
+static void
+load_offsets(const struct agx_index *index, struct frame_offsets *o, unsigned frame)
+{
+	if (o->frame == frame)
+		return;
+
+	const struct agx_index_frame *f = &index->frames[frame];
+	const struct agx_index_packet *all = &index->packets[f->first_packet];
+
+	free(o->offsets);
+	o->offsets = malloc((f->packet_count + 1) * sizeof(*o->offsets));
+	o->count = f->packet_count;
+	o->frame = frame;
+
+	for (unsigned i = 0; i < f->packet_count; ++i)
+		o->offsets[i] = all[i].offset;
+
+	qsort(o->offsets, o->count, sizeof(*o->offsets), cmp_offset);
+	o->offsets[o->count] = f->output_size;
+}
+
+static void
+print_packet(const struct agx_index *index, struct output *out,
+	     struct frame_offsets *o, unsigned frame, uint32_t offset)
+{
+	load_offsets(index, o, frame);
+
+	/* First offset past this packet's */
+	unsigned lo = 0, hi = o->count;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+
+		if (o->offsets[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	output_write(out, index->frames[frame].output_offset + offset,
+		     o->offsets[lo] - offset, stdout);
+}
+
+static void
+print_packets(const struct agx_index *index, struct output *out,
+	      unsigned frame, uint32_t type)
+{
+	struct frame_offsets o = { .frame = -1 };
+	unsigned count;
+	const struct agx_index_packet *packets =
+		agx_index_find_type(index, frame, type, &count);
+
+	for (unsigned i = 0; i < count; ++i)
+		print_packet(index, out, &o, frame, packets[i].offset);
+
+	free(o.offsets);
+}
+
+/* Every address field referencing bytes in [start, end), followed by its
+ * packet when the output is given */
+static void
+print_references(const struct agx_index *index, struct output *out,
+		 uint64_t start, uint64_t end)
+{
+	struct frame_offsets o = { .frame = -1 };
+	uint64_t count;
+	const struct agx_index_address *refs =
+		agx_index_find_addresses(index, start, end, &count);
+
+	for (uint64_t i = 0; i < count; ++i) {
+		const struct agx_index_address *ref = &refs[i];
+
+		if (!agx_index_address_overlaps(ref, start, end))
+			continue;
+
+		printf("frame %u encoder %u offset %u %s %s 0x%llx", ref->frame,
+		       ref->encoder, ref->offset, agx_index_type_name(index, ref->type),
+		       agx_index_field_name(index, ref->field),
+		       (unsigned long long) ref->address);
+
+		if (ref->size)
+			printf("+0x%x", ref->size);
+
+		printf("\n");
+
+		if (out) {
+			print_packet(index, out, &o, ref->frame, ref->offset);
+		}
+	}
+
+	free(o.offsets);
+}
+
+/* START, START-END or START+SIZE, a single address if no end is given */
+static void
+parse_range(const char *str, uint64_t *start, uint64_t *end)
+{
+	char *p;
+	*start = strtoull(str, &p, 0);
+
+	if (*p == '-')
+		*end = strtoull(p + 1, &p, 0);
+	else if (*p == '+')
+		*end = *start + strtoull(p + 1, &p, 0);
+	else
+		*end = *start + 1;
+
+	if (*p || p == str || *end <= *start)
+		errx(1, "bad address range %s", str);
+}
+
+static void
+list(const struct agx_index *index)
+{
+	const struct agx_index_header *h = index->header;
+
+	printf("%u frames, %llu packets, %llu addresses, %llu bytes of output\n",
+	       h->frame_count, (unsigned long long) h->packet_count,
+	       (unsigned long long) h->address_count,
+	       (unsigned long long) h->output_size);
+
+	for (unsigned i = 0; i < h->type_count; ++i)
+		printf("type %u %s\n", index->types[i].id, index->types[i].name);
+
+	for (unsigned i = 0; i < h->field_count; ++i)
+		printf("field %u %s\n", index->fields[i].id, index->fields[i].name);
+
+	for (unsigned i = 0; i < h->frame_count; ++i) {
+		const struct agx_index_frame *f = &index->frames[i];
+
+		printf("frame %u output %llu+%llu capture %llu packets %u\n", i,
+		       (unsigned long long) f->output_offset,
+		       (unsigned long long) f->output_size,
+		       (unsigned long long) f->capture_offset, f->packet_count);
+	}
+}
+
+static void
+open_output(struct output *out, const char *path)
+{
+	*out = (struct output) { .block = -1 };
+	out->map = map_file(path, &out->size);
+	out->packed = agx_lz_is_stream(out->map, out->size);
+
+	if (out->packed)
+		out->raw = malloc(AGX_LZ_BLOCK_SIZE);
+}
+
+static void
+close_output(struct output *out)
+{
+	free(out->raw);
+	munmap((void *) out->map, out->size);
+}
+
+#define USAGE "usage: query-bin INDEX [OUTPUT FRAME [TYPE]], or query-bin -a RANGE INDEX [OUTPUT]"
+
+int main(int argc, char **argv)
+{
+	const char *range = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:")) != -1) {
+		switch (c) {
+		case 'a':
+			range = optarg;
+			break;
+		default:
+			errx(1, USAGE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (range ? (argc != 1 && argc != 2) : (argc != 1 && argc != 3 && argc != 4))
+		errx(1, USAGE);
+
+	struct agx_index index;
+	if (!agx_index_open(&index, argv[0]))
+		errx(2, "%s: not an index", argv[0]);
+
+	struct output out;
+	if (argc > 1)
+		open_output(&out, argv[1]);
+
+	if (range) {
+		uint64_t start, end;
+		parse_range(range, &start, &end);
+		print_references(&index, argc > 1 ? &out : NULL, start, end);
+	} else if (argc == 1) {
+		list(&index);
+	} else {
+		char *end;
+		unsigned long frame = strtoul(argv[2], &end, 0);
+		if (*end || frame >= index.header->frame_count)
+			errx(1, "no frame %s", argv[2]);
+
+		if (argc == 4) {
+			uint32_t type;
+			if (!agx_index_type_id(&index, argv[3], &type))
+				errx(1, "no packets of type %s", argv[3]);
+
+			print_packets(&index, &out, frame, type);
+		} else {
+			const struct agx_index_frame *f = &index.frames[frame];
+			output_write(&out, f->output_offset, f->output_size, stdout);
+		}
+	}
+
+	if (argc > 1)
+		close_output(&out);
+
+	agx_index_close(&index);
+	return 0;
+}
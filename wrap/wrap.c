@@ -51,6 +51,26 @@
 
 mach_port_t metal_connection = 0;
 
+/* Decoder state for the traced process, created on first use */
+
+static struct pandecode_context *
+wrap_decode_ctx(void)
+{
+	static struct pandecode_context *ctx = NULL;
+
+	if (!ctx) {
+		ctx = pandecode_create_context();
+
+		/* Summary line per frame rather than a full dump */
+		if (getenv("ASAHI_STATS"))
+			pandecode_set_format(ctx, PANDECODE_FORMAT_STATS);
+		else if (getenv("ASAHI_WASTE"))
+			pandecode_set_format(ctx, PANDECODE_FORMAT_WASTE);
+	}
+
+	return ctx;
+}
+
 kern_return_t
 wrap_IOConnectCallMethod(
 	mach_port_t	 connection,		// In
@@ -103,10 +123,15 @@ wrap_IOConnectCallMethod(
 
 		const struct agx_submit_cmdbuf_req *req = inputStruct;
 
-		pandecode_cmdstream(req->cmdbuf, false);
+		/* Capture before decoding, so a decoder crash still leaves
+		 * the submission on disk for decode-bin */
+		if (getenv("ASAHI_CAPTURE"))
+			pandecode_capture_submit(wrap_decode_ctx(), req->cmdbuf);
+
+		pandecode_cmdstream(wrap_decode_ctx(), req->cmdbuf, false);
 
 		if (getenv("ASAHI_DUMP"))
-			pandecode_dump_mappings();
+			pandecode_dump_mappings(wrap_decode_ctx());
 
 		/* fallthrough */
 	default:
@@ -130,6 +155,11 @@ wrap_IOConnectCallMethod(
 
 	printf("return %u", ret);
 
+	/* A rejected submission usually means a GPU fault, so keep the trace
+	 * leading up to it */
+	if (selector == AGX_SELECTOR_SUBMIT_COMMAND_BUFFERS && ret != KERN_SUCCESS)
+		pandecode_ring_trigger(wrap_decode_ctx(), "submission failed");
+
 	/* Dump the outputs */
 	if(outputCnt) {
 		printf("%u scalars: ", *outputCnt);
@@ -163,7 +193,7 @@ wrap_IOConnectCallMethod(
 		uint64_t *ptr = (uint64_t *) outputStruct;
 		uint32_t *words = (uint32_t *) (ptr + 1);
 
-		pandecode_track_alloc((struct agx_allocation) {
+		pandecode_track_alloc(wrap_decode_ctx(), (struct agx_allocation) {
 			.index = words[1],
 			.map = (void *) *ptr,
 			.size = words[0],
@@ -196,7 +226,7 @@ wrap_IOConnectCallMethod(
 		else
 			printf(" unknown type %08X\n", iwords[20]);
 
-		pandecode_track_alloc((struct agx_allocation) {
+		pandecode_track_alloc(wrap_decode_ctx(), (struct agx_allocation) {
 			.type = AGX_ALLOC_REGULAR,
 			.size = size,
 			.index = ptrs[3] >> 32ull,